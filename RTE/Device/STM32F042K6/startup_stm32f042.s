@@ -49,7 +49,7 @@ __initial_sp
 ;   <o>  Heap Size (in Bytes) <0x0-0xFFFFFFFF:8>
 ; </h>
 
-Heap_Size       EQU     0x0000D00 ; 3840
+Heap_Size       EQU     0x0000A00 ; 2560
 
                 AREA    HEAP, NOINIT, READWRITE, ALIGN=3
 __heap_base
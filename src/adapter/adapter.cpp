@@ -19,8 +19,26 @@
 using namespace std;
 using namespace util;
 
+// The command line queue depth, one is running, one is being received.
+// Each line costs CMD_LINE_LEN + 1 bytes of static RAM, keep it small
+#ifndef CMD_QUEUE_LEN
+#define CMD_QUEUE_LEN 2
+#endif
+
+// The queue holds the raw characters only, the running line is parsed
+// into the one DataCollector and its data buffer
+struct CmdLine {
+    char    chars[CMD_LINE_LEN];
+    uint8_t length;
+};
+
 static CmdUart* glblUart;
 static DataCollector* collector = DataCollector::instance();
+static CmdLine CmdLines[CMD_QUEUE_LEN];
+static volatile uint32_t CmdHead; // The line being received, written by ISR only
+static volatile uint32_t CmdTail; // The next line to run, written by main loop only
+static volatile bool watchBreak; // The running command could be stopped
+static volatile bool userBreak;
 
 /**
  * Enable the clocks and peripherals, initialize the drivers
@@ -44,6 +62,18 @@ static bool UserUartRcvHandler(uint8_t ch)
 {
     bool ready = false;
     
+    // No free line, the character is lost, while watching it is the break
+    if ((CmdHead - CmdTail) == CMD_QUEUE_LEN) {
+        userBreak = watchBreak;
+        return false;
+    }
+    
+    CmdLine* line = &CmdLines[CmdHead % CMD_QUEUE_LEN];
+    if (watchBreak && ch == '\r' && line->length == 0) {
+        userBreak = true; // Bare CR is the break, not the empty line repeating the command
+        return false;
+    }
+    
     if (AdapterConfig::instance()->getBoolProperty(PAR_ECHO) && ch != '\n') {
         glblUart->send(ch);
         if (ch == '\r' && AdapterConfig::instance()->getBoolProperty(PAR_LINEFEED)) {
@@ -52,15 +82,50 @@ static bool UserUartRcvHandler(uint8_t ch)
     }
     
     if (ch == '\r') { // Got cmd terminator
+        CmdHead = CmdHead + 1; // Publish to the main loop
         ready = true;
     }
-    else if (isprint(ch)) { // this will skip '\n' as well
-        collector->putChar(ch);
+    else if (isprint(ch) && ch != ' ') { // this will skip '\n' as well
+        if (line->length < CMD_LINE_LEN) {
+            line->chars[line->length++] = ch;
+        }
     }
     
     return ready;
 }
 
+/**
+ * Start or stop watching UART for the user break. The characters go to
+ * the line queue, only the one not fitting there is the break
+ * @param[in] val true to start watching
+ */
+void AdptWatchUserBreak(bool val)
+{
+    userBreak = false;
+    watchBreak = val;
+}
+
+/**
+ * Check for the user break
+ * @return true if the character was dropped since AdptWatchUserBreak(true)
+ */
+bool AdptUserBreak()
+{
+    return userBreak;
+}
+
+/**
+ * Check for the next command, the host sent any character after the running one
+ * @return true if the next command line is started or queued
+ */
+bool AdptCmdPending()
+{
+    uint32_t lines = CmdHead - CmdTail;
+    if (lines == CMD_QUEUE_LEN)
+        return lines > 1; // No line being received
+    return lines > 1 || CmdLines[CmdHead % CMD_QUEUE_LEN].length;
+}
+
 /**
  * Send string to UART
  * @param[in] str String to send
@@ -82,12 +147,24 @@ static void AdapterRun()
     AdptDispatcherInit();
 
     for(;;) {    
-        if (glblUart->ready()) {
+        // The host could send the next command while the current one runs
+        while (CmdTail != CmdHead) {
             glblUart->ready(false);
+            CmdLine* line = &CmdLines[CmdTail % CMD_QUEUE_LEN];
+            for (int i = 0; i < line->length; i++) {
+                collector->putChar(line->chars[i]);
+            }
             AdptOnCmd(collector);
             collector->reset();
+            line->length = 0;
+            CmdTail = CmdTail + 1; // Release the line to the receive interrupt
+        }
+        
+        __disable_irq();
+        if (CmdTail == CmdHead) {
+            __WFI(); // goto sleep
         }
-        __WFI(); // goto sleep
+        __enable_irq();
     }
 
 }
@@ -21,6 +21,7 @@ const int OBD_IN_MSG_DLEN  = 255;                            // Binary len
 const int OBD_OUT_MSG_DLEN = 255;                            // Binary len
 const int OBD_OUT_MSG_LEN  = OBD_OUT_MSG_DLEN + KWP_HDR_LEN; // Binary buffer size
 const int TX_BUFFER_LEN    = OBD_OUT_MSG_LEN * 3;            // Char buffer size
+const int CMD_LINE_LEN     = 64;                             // Queued command chars
 
 //
 // Command dispatch values
@@ -45,6 +46,7 @@ enum AT_Requests {
     PAR_CAN_MONITORING,
     PAR_CAN_SEND_RTR,
     PAR_CAN_SHOW_STATUS,
+    PAR_CAN_TIMESTAMP,
     PAR_CAN_VAIDATE_DLC,
     PAR_CHIP_COPYRIGHT,
     PAR_DESCRIBE_PROTCL_N,
@@ -58,6 +60,7 @@ enum AT_Requests {
     PAR_LINEFEED,
     PAR_LOW_POWER_MODE,
     PAR_MEMORY,
+    PAR_MONITOR_ALL,
     PAR_PROTOCOL_CLOSE,
     PAR_READ_VOLT,
     PAR_RESET_CPU,
@@ -173,6 +176,9 @@ void AdptDispatcherInit();
 void AdptOnCmd(const DataCollector* collectorg);
 void AdptReadSerialNum();
 void AdptPowerModeConfigure();
+void AdptWatchUserBreak(bool val);
+bool AdptUserBreak();
+bool AdptCmdPending();
 
 // Utilities
 void Delay1ms(uint32_t value);
@@ -180,6 +186,7 @@ void StartDelay1ms(uint32_t value);
 void Delay1us(uint32_t value);
 void KWordsToString(const uint8_t* kw, util::string& str);
 void CanIDToString(uint32_t num, util::string& str, bool extended);
+void TimestampToString(uint32_t usec, util::string& str);
 void AutoReceiveParse(const util::string& str, uint32_t& filter, uint32_t& mask);
 
 uint32_t to_bytes(const util::string& str, uint8_t* bytes);
@@ -15,8 +15,8 @@
 using namespace std;
 using namespace util;
 
-const int STR_LEN = 14;
-const int DAT_LEN = OBD_IN_MSG_DLEN;
+const int STR_LEN = 64; // STPX carries the header, data and options
+const int DAT_LEN = CMD_LINE_LEN / 2;
 
 DataCollector::DataCollector() 
   : str_(STR_LEN), length_(0), previous_(0), binary_(true)
@@ -48,6 +48,18 @@ void DataCollector::putChar(char ch)
     }
 }
 
+/**
+ * The expected number of responses, the odd hex digit after the data, "010C1"
+ * @return The number of responses, 0 if not given
+ */
+int DataCollector::getResponseNum() const
+{
+    if (!binary_ || !previous_)
+        return 0;
+    char digit[] = { previous_, 0 };
+    return strtoul(digit, 0, 16);
+}
+
 DataCollector* DataCollector::instance()
 {
     static DataCollector instance;
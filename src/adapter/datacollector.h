@@ -16,6 +16,7 @@ public:
     const uint8_t* getData() const { return data_; }
     uint16_t getLength() const { return length_; }
     bool isData() const { return binary_; }
+    int getResponseNum() const;
     void putChar(char ch);
     void reset();
     static DataCollector* instance();
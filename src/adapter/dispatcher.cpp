@@ -7,6 +7,7 @@
 
 #include <climits>
 #include <cstdio>
+#include <cctype>
 #include <adaptertypes.h>
 #include "datacollector.h"
 #include <obd/j1979.h>
@@ -14,6 +15,8 @@
 #include <algorithms.h>
 #include <CmdUart.h>
 #include <AdcDriver.h>
+#include <CanDriver.h>
+#include <CanFilter.h>
 #include <obd/isocan.h>
 
 using namespace util;
@@ -117,45 +120,89 @@ static void OnSetOK(const string& cmd, int par)
 }
 
 /**
- * Just a stub
+ * Select the adaptive timing mode, "ATAT0/1/2", only one is set
+ * @param[in] cmd Command line, ignored
+ * @param[in] par The number in dispatch table
+ */
+static void OnSetAdaptiveTiming(const string& cmd, int par)
+{
+    AdapterConfig* config = AdapterConfig::instance();
+    config->setBoolProperty(PAR_ADPTV_TIM0, par == PAR_ADPTV_TIM0);
+    config->setBoolProperty(PAR_ADPTV_TIM1, par == PAR_ADPTV_TIM1);
+    config->setBoolProperty(PAR_ADPTV_TIM2, par == PAR_ADPTV_TIM2);
+    AdptSendReply(OkMessage);
+}
+
+/**
+ * Show CAN error counters, the error events and the receive overflows, "ATCS"
  * @param[in] cmd Command line, ignored
  * @param[in] par The number in dispatch table, ignored
  */
 static void OnCanShowStatus(const string& cmd, int par)
 {
+    char out[40];
+    CanErrorStats stats;
+    CanRxStats rxStats;
+    CanDriver* driver = CanDriver::instance();
+    
+    driver->getErrorStats(stats);
+    sprintf(out, "T:%02X R:%02X", stats.tec, stats.rec);
+    AdptSendReply(out);
+    sprintf(out, "WRN:%u PAS:%u BOF:%u LEC:%u", static_cast<unsigned>(stats.warnings),
+        static_cast<unsigned>(stats.passives), static_cast<unsigned>(stats.busOffs),
+        static_cast<unsigned>(stats.lecErrors));
+    AdptSendReply(out);
+    driver->getRxStats(rxStats);
+    sprintf(out, "OVF:%u FOV:%u", static_cast<unsigned>(rxStats.overflows), static_cast<unsigned>(rxStats.overruns));
+    AdptSendReply(out);
+    if (driver->isBusOff()) {
+        AdptSendReply("BUS OFF");
+    }
 }
 
 /**
- * Set CAN receive address
- * @param[in] cmd Command line
- * @param[in] par The number in dispatch table, ignored
+ * Set CAN filter/mask from the receive address, "X" is a wildcard digit
+ * @param[in] addr The receive address, empty to clear
+ * @return true if OK, false if the wrong address length
  */
-static void OnCanSetReceiveAddress(const string& cmd, int par)
+static bool SetReceiveAddress(const string& addr)
 {
     ByteArray bytes;
-    
     AdapterConfig* config = AdapterConfig::instance();
     
-    if (cmd.length() == 0) {
+    if (addr.length() == 0) {
         config->setBytesProperty(PAR_CAN_FILTER, &bytes);
         config->setBytesProperty(PAR_CAN_MASK, &bytes);
     }
-    else if (cmd.length() == 3 || cmd.length() == 8) {
+    else if (addr.length() == 3 || addr.length() == 8) {
         IntAggregate mask, filter;
-        AutoReceiveParse(cmd, filter.lvalue, mask.lvalue);
-        bytes.length = 2;
+        AutoReceiveParse(addr, filter.lvalue, mask.lvalue);
+        bytes.length = (addr.length() == 3) ? 2 : 4;
         memcpy(bytes.data, filter.bvalue, 4);
         config->setBytesProperty(PAR_CAN_FILTER, &bytes);
         memcpy(bytes.data, mask.bvalue, 4);
         config->setBytesProperty(PAR_CAN_MASK, &bytes);
     }
+    else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Set CAN receive address
+ * @param[in] cmd Command line
+ * @param[in] par The number in dispatch table, ignored
+ */
+static void OnCanSetReceiveAddress(const string& cmd, int par)
+{
+    if (SetReceiveAddress(cmd)) {
+        OBDProfile::instance()->setFilterAndMask();
+        AdptSendReply(OkMessage);
+    }
     else {
         AdptSendReply(ErrMessage);
-        return;
     }
-    
-    OBDProfile::instance()->setFilterAndMask();
-    AdptSendReply(OkMessage);
 }
 
 /**
@@ -299,6 +346,26 @@ static void OnKwDisplay(const string& cmd, int par)
     OBDProfile::instance()->kwDisplay();
 }
 
+/**
+ * Monitor all the bus traffic until any character received, "ATMA"
+ * @param[in] cmd Command line, ignored
+ * @param[in] par The number in dispatch table, ignored
+ */
+static void OnMonitorAll(const string& cmd, int par)
+{
+    OBDProfile::instance()->monitor();
+}
+
+/**
+ * Send CAN remote frame, "ATRTR"
+ * @param[in] cmd Command line, ignored
+ * @param[in] par The number in dispatch table, ignored
+ */
+static void OnCanSendRtr(const string& cmd, int par)
+{
+    OBDProfile::instance()->sendRtr();
+}
+
 /**
  * Close the protocol, set the disconnected status, "ATPC"
  * @param[in] cmd Command line, ignored
@@ -425,6 +492,420 @@ static void OnCanSetTimeoutMult(const string& cmd, int par)
     AdptSendReply(OkMessage);
 }
 
+/**
+ * Parse the filter argument "ID[,MASK]", 3 digits for 11 bit or 8 digits for 29 bit
+ * @param[in] arg The command argument
+ * @param[out] id CAN ID
+ * @param[out] mask CAN mask, all ones if omitted
+ * @param[out] extended CAN 29 bit flag
+ * @return true if parsed, false otherwise
+ */
+static bool ParseFilterArg(const string& arg, uint32_t& id, uint32_t& mask, bool& extended)
+{
+    uint32_t pos = arg.find(',');
+    uint32_t idLen = (pos != string::npos) ? pos : arg.length();
+    
+    if (idLen != 3 && idLen != 8)
+        return false;
+    for (char ch : arg) {
+        if (!isxdigit(ch) && ch != ',')
+            return false;
+    }
+    
+    extended = (idLen == 8);
+    id = stoul(arg.substr(0, idLen), 0, 16);
+    mask = extended ? 0x1FFFFFFF : 0x7FF;
+    if (pos != string::npos) {
+        if ((arg.length() - pos - 1) != idLen || arg.find(',', pos + 1) != string::npos)
+            return false; // The mask has to be the same size, one comma only
+        mask = stoul(arg.substr(pos + 1), 0, 16);
+    }
+    return true;
+}
+
+/**
+ * Add CAN pass filter, "STFAP ID[,MASK]"
+ * @param[in] cmd Command line
+ * @param[in] par The number in dispatch table, ignored
+ */
+static void OnCanAddPassFilter(const string& cmd, int par)
+{
+    uint32_t id, mask;
+    bool extended;
+    
+    if (ParseFilterArg(cmd, id, mask, extended) && CanFilterTable::instance()->addPass(id, mask, extended)) {
+        AdptSendReply(OkMessage);
+    }
+    else {
+        AdptSendReply(ErrMessage);
+    }
+}
+
+/**
+ * Remove CAN pass filter, "STFRP ID[,MASK]"
+ * @param[in] cmd Command line
+ * @param[in] par The number in dispatch table, ignored
+ */
+static void OnCanRemovePassFilter(const string& cmd, int par)
+{
+    uint32_t id, mask;
+    bool extended;
+    
+    if (ParseFilterArg(cmd, id, mask, extended) && CanFilterTable::instance()->removePass(id, mask, extended)) {
+        AdptSendReply(OkMessage);
+    }
+    else {
+        AdptSendReply(ErrMessage);
+    }
+}
+
+/**
+ * Add CAN block filter, "STFAB ID[,MASK]"
+ * @param[in] cmd Command line
+ * @param[in] par The number in dispatch table, ignored
+ */
+static void OnCanAddBlockFilter(const string& cmd, int par)
+{
+    uint32_t id, mask;
+    bool extended;
+    
+    if (ParseFilterArg(cmd, id, mask, extended) && CanFilterTable::instance()->addBlock(id, mask, extended)) {
+        AdptSendReply(OkMessage);
+    }
+    else {
+        AdptSendReply(ErrMessage);
+    }
+}
+
+/**
+ * Clear CAN pass filters, "STFCP"
+ * @param[in] cmd Command line, ignored
+ * @param[in] par The number in dispatch table, ignored
+ */
+static void OnCanClearPassFilters(const string& cmd, int par)
+{
+    CanFilterTable::instance()->clearPass();
+    AdptSendReply(OkMessage);
+}
+
+/**
+ * Clear CAN block filters, "STFCB"
+ * @param[in] cmd Command line, ignored
+ * @param[in] par The number in dispatch table, ignored
+ */
+static void OnCanClearBlockFilters(const string& cmd, int par)
+{
+    CanFilterTable::instance()->clearBlock();
+    AdptSendReply(OkMessage);
+}
+
+/**
+ * Print the filter entry as "ID,MASK"
+ * @param[in] entry The filter entry
+ */
+static void SendFilterEntry(const CanFilterEntry* entry)
+{
+    char out[20];
+    
+    if (entry->id & CanFilterTable::FILTER_EXT) {
+        sprintf(out, "%08X,%08X", (entry->id & ~CanFilterTable::FILTER_EXT), entry->mask);
+    }
+    else {
+        sprintf(out, "%03X,%03X", entry->id, entry->mask);
+    }
+    AdptSendReply(out);
+}
+
+/**
+ * List CAN pass filters, "STFLP"
+ * @param[in] cmd Command line, ignored
+ * @param[in] par The number in dispatch table, ignored
+ */
+static void OnCanListPassFilters(const string& cmd, int par)
+{
+    const CanFilterTable* filters = CanFilterTable::instance();
+    
+    for (int i = 0; i < filters->getPassNum(); i++) {
+        SendFilterEntry(filters->getPass(i));
+    }
+    AdptSendReply(OkMessage);
+}
+
+/**
+ * List CAN block filters, "STFLB"
+ * @param[in] cmd Command line, ignored
+ * @param[in] par The number in dispatch table, ignored
+ */
+static void OnCanListBlockFilters(const string& cmd, int par)
+{
+    const CanFilterTable* filters = CanFilterTable::instance();
+    
+    for (int i = 0; i < filters->getBlockNum(); i++) {
+        SendFilterEntry(filters->getBlock(i));
+    }
+    AdptSendReply(OkMessage);
+}
+
+/**
+ * Add CAN flow control address pair, "STCFCPA TXID,RXID"
+ * @param[in] cmd Command line
+ * @param[in] par The number in dispatch table, ignored
+ */
+static void OnCanAddFlowPair(const string& cmd, int par)
+{
+    uint32_t pos = cmd.find(',');
+    uint32_t idLen = (pos != string::npos) ? pos : 0;
+    bool valid = (idLen == 3 || idLen == 8) && (cmd.length() - pos - 1) == idLen
+                 && cmd.find(',', pos + 1) == string::npos;
+    
+    for (char ch : cmd) {
+        if (!isxdigit(ch) && ch != ',')
+            valid = false;
+    }
+    if (valid) {
+        uint32_t txId = stoul(cmd.substr(0, idLen), 0, 16);
+        uint32_t rxId = stoul(cmd.substr(pos + 1), 0, 16);
+        valid = FlowControlTable::instance()->add(txId, rxId, idLen == 8);
+    }
+    AdptSendReply(valid ? OkMessage : ErrMessage);
+}
+
+/**
+ * Clear CAN flow control address pairs, "STCFCPC"
+ * @param[in] cmd Command line, ignored
+ * @param[in] par The number in dispatch table, ignored
+ */
+static void OnCanClearFlowPairs(const string& cmd, int par)
+{
+    FlowControlTable::instance()->clear();
+    AdptSendReply(OkMessage);
+}
+
+/**
+ * Check the string for the digits only
+ * @param[in] str The string
+ * @param[in] hex true for the hex digits, false for decimal
+ * @return true if not empty and the digits only
+ */
+static bool IsNumber(const string& str, bool hex)
+{
+    for (char ch : str) {
+        if (hex ? !isxdigit(ch) : !isdigit(ch))
+            return false;
+    }
+    return !str.empty();
+}
+
+/**
+ * Set the header bytes like ATSH, 3, 6 or 8 hex digits
+ * @param[in] hdr The header
+ * @return true if OK, false if wrong header
+ */
+static bool SetHeader(const string& hdr)
+{
+    AdapterConfig* config = AdapterConfig::instance();
+    ByteArray cpBytes, hdrBytes;
+    
+    if (!IsNumber(hdr, true))
+        return false;
+    
+    switch (hdr.length()) {
+        case 3:
+            hdrBytes.length = to_bytes("0" + hdr, hdrBytes.data); //1.5 bytes
+            break;
+        case 6:
+            hdrBytes.length = to_bytes(hdr, hdrBytes.data);
+            break;
+        case 8:
+            cpBytes.length = to_bytes(hdr.substr(0, 2), cpBytes.data);
+            config->setBytesProperty(PAR_CAN_PRIORITY_BITS, &cpBytes);
+            hdrBytes.length = to_bytes(hdr.substr(2), hdrBytes.data);
+            break;
+        default:
+            return false;
+    }
+    config->setBytesProperty(PAR_HEADER_BYTES, &hdrBytes);
+    return true;
+}
+
+/**
+ * Send the request with the one-off settings,
+ * "STPX H:hdr,D:data,R:responses,T:timeout,F:receive address"
+ * only D: is required, the timeout is in ms, the settings are restored after
+ * @param[in] cmd Command line
+ * @param[in] par The number in dispatch table, ignored
+ */
+static void OnSendRequestEx(const string& cmd, int par)
+{
+    const uint32_t MAX_DATA_LEN = 32;
+    AdapterConfig* config = AdapterConfig::instance();
+    uint8_t data[MAX_DATA_LEN];
+    int len = 0;
+    int numOfResp = 0;
+    uint32_t timeout = 0;
+    string hdr(8), addr(8);
+    bool valid = true;
+    
+    // The comma separated "K:VALUE" fields
+    uint32_t pos = 0;
+    while (valid && pos < cmd.length()) {
+        uint32_t end = cmd.find(',', pos);
+        if (end == string::npos) {
+            end = cmd.length();
+        }
+        string field = cmd.substr(pos, end - pos);
+        pos = end + 1;
+        
+        if (field.length() < 3 || field[1] != ':') {
+            valid = false;
+            break;
+        }
+        string val = field.substr(2);
+        switch (field[0]) {
+            case 'H':
+                hdr = val;
+                valid = IsNumber(val, true) && (val.length() == 3 || val.length() == 6 || val.length() == 8);
+                break;
+            case 'D':
+                valid = IsNumber(val, true) && !(val.length() % 2) && (val.length() / 2) <= MAX_DATA_LEN;
+                len = valid ? to_bytes(val, data) : 0;
+                valid = (len > 0);
+                break;
+            case 'R':
+                valid = IsNumber(val, false) && val.length() <= 2;
+                numOfResp = valid ? stoul(val) : 0;
+                break;
+            case 'T':
+                valid = IsNumber(val, false) && val.length() <= 4;
+                timeout = valid ? stoul(val) : 0;
+                break;
+            case 'F':
+                addr = val;
+                valid = (val.length() == 3 || val.length() == 8);
+                for (char ch : val) {
+                    if (!isxdigit(ch) && ch != 'X')
+                        valid = false;
+                }
+                break;
+            default:
+                valid = false;
+        }
+    }
+    if (!valid || len == 0) {
+        AdptSendReply(ErrMessage);
+        return;
+    }
+    
+    // Keep the settings to restore
+    ByteArray savedHdr = *config->getBytesProperty(PAR_HEADER_BYTES);
+    ByteArray savedPrio = *config->getBytesProperty(PAR_CAN_PRIORITY_BITS);
+    ByteArray savedFilter = *config->getBytesProperty(PAR_CAN_FILTER);
+    ByteArray savedMask = *config->getBytesProperty(PAR_CAN_MASK);
+    uint32_t savedTimeout = config->getIntProperty(PAR_TIMEOUT);
+    uint32_t savedMult = config->getIntProperty(PAR_CAN_TIMEOUT_MULT);
+    
+    // All the fields are checked above, the settings could not fail here
+    if (!hdr.empty()) {
+        SetHeader(hdr);
+    }
+    if (!addr.empty()) {
+        SetReceiveAddress(addr);
+        OBDProfile::instance()->setFilterAndMask();
+    }
+    if (timeout > 0) {
+        uint32_t val = (timeout + 3) / 4; // ATST units, 4 ms
+        config->setIntProperty(PAR_TIMEOUT, (val > 0xFF) ? 0xFF : val);
+        config->setIntProperty(PAR_CAN_TIMEOUT_MULT, 1);
+    }
+    
+    OBDProfile::instance()->onRequest(data, len, numOfResp);
+    
+    config->setBytesProperty(PAR_HEADER_BYTES, &savedHdr);
+    config->setBytesProperty(PAR_CAN_PRIORITY_BITS, &savedPrio);
+    config->setBytesProperty(PAR_CAN_FILTER, &savedFilter);
+    config->setBytesProperty(PAR_CAN_MASK, &savedMask);
+    config->setIntProperty(PAR_TIMEOUT, savedTimeout);
+    config->setIntProperty(PAR_CAN_TIMEOUT_MULT, savedMult);
+    if (!addr.empty()) {
+        OBDProfile::instance()->setFilterAndMask();
+    }
+}
+
+/**
+ * Mode 01 request of the hex PID list batched on the adapter, "STPIDS 0C0D05",
+ * one "41 PID data" reply per supported PID
+ * @param[in] cmd Command line
+ * @param[in] par The number in dispatch table, ignored
+ */
+static void OnPidBatch(const string& cmd, int par)
+{
+    const uint32_t MAX_PID_NUM = 20;
+    uint8_t pids[MAX_PID_NUM];
+    
+    if (!IsNumber(cmd, true) || (cmd.length() % 2) || (cmd.length() / 2) > MAX_PID_NUM) {
+        AdptSendReply(ErrMessage);
+        return;
+    }
+    int num = to_bytes(cmd, pids);
+    OBDProfile::instance()->batchPids(pids, num);
+}
+
+/**
+ * Loopback throughput self-test, "STLBT [FRAMES[,DLC]]", hex frame number
+ * @param[in] cmd Command line
+ * @param[in] par The number in dispatch table, ignored
+ */
+static void OnLoopbackTest(const string& cmd, int par)
+{
+    const uint32_t DEFAULT_FRAME_NUM = 0x400;
+    uint32_t frameNum = DEFAULT_FRAME_NUM;
+    uint32_t dlc = 8;
+    
+    if (!cmd.empty()) {
+        uint32_t pos = cmd.find(',');
+        uint32_t numLen = (pos != string::npos) ? pos : cmd.length();
+        for (char ch : cmd) {
+            if (!isxdigit(ch) && ch != ',') {
+                AdptSendReply(ErrMessage);
+                return;
+            }
+        }
+        if (numLen == 0 || numLen > 4 || (pos != string::npos && (cmd.length() - pos) != 2)) {
+            AdptSendReply(ErrMessage);
+            return;
+        }
+        frameNum = stoul(cmd.substr(0, numLen), 0, 16);
+        if (pos != string::npos) {
+            dlc = stoul(cmd.substr(pos + 1), 0, 16);
+        }
+        if (frameNum == 0 || dlc > 8) {
+            AdptSendReply(ErrMessage);
+            return;
+        }
+    }
+    
+    CmdUart* uart = CmdUart::instance();
+    LoopbackStats stats;
+    uint32_t txBytes = uart->getTxBytes();
+    OBDProfile::instance()->loopbackTest(frameNum, dlc, stats);
+    txBytes = uart->getTxBytes() - txBytes;
+    
+    // Rates per second, 64 bit to avoid the overflow
+    uint32_t elapsed = stats.elapsed ? stats.elapsed : 1;
+    uint32_t fps = static_cast<uint64_t>(stats.received) * 1000000 / elapsed;
+    uint32_t bps = static_cast<uint64_t>(txBytes) * 1000000 / elapsed;
+    
+    char out[32];
+    sprintf(out, "FRAMES:%u", static_cast<unsigned>(stats.received));
+    AdptSendReply(out);
+    sprintf(out, "DROPPED:%u", static_cast<unsigned>(frameNum - stats.received));
+    AdptSendReply(out);
+    sprintf(out, "FRAMES/S:%u", static_cast<unsigned>(fps));
+    AdptSendReply(out);
+    sprintf(out, "UART B/S:%u", static_cast<unsigned>(bps));
+    AdptSendReply(out);
+}
+
 /**
  * Set adapter default parameters
  */
@@ -442,6 +923,8 @@ static void SetDefault()
     config->setBoolProperty(PAR_CAN_DLC, false);
     config->setBoolProperty(PAR_CAN_FLOW_CONTROL, true);
     config->setBoolProperty(PAR_CAN_CAF, true);
+    config->setBoolProperty(PAR_CAN_MONITORING, true);
+    config->setBoolProperty(PAR_ADPTV_TIM1, true);
     config->setIntProperty(PAR_ISO_INIT_ADDRESS, 0x33);
     config->setIntProperty(PAR_WAKEUP_VAL, (DEFAULT_WAKEUP_TIME / 20));
     config->setIntProperty(PAR_CAN_TSTR_ADDRESS, TESTER_ADDRESS);
@@ -489,9 +972,9 @@ static const DispatchType dispatchTbl[] = {
     { "@1",     PAR_VERSION,           0,  0, OnSendReplyVersion     },
     { "AL",     PAR_ALLOW_LONG,        0,  0, OnSetOK                },
     { "AR",     PAR_DUMMY,             0,  0, OnSetOK                },
-    { "AT0",    PAR_ADPTV_TIM0,        0,  0, OnSetOK                },
-    { "AT1",    PAR_ADPTV_TIM1,        0,  0, OnSetOK                },
-    { "AT2",    PAR_ADPTV_TIM2,        0,  0, OnSetOK                },
+    { "AT0",    PAR_ADPTV_TIM0,        0,  0, OnSetAdaptiveTiming    },
+    { "AT1",    PAR_ADPTV_TIM1,        0,  0, OnSetAdaptiveTiming    },
+    { "AT2",    PAR_ADPTV_TIM2,        0,  0, OnSetAdaptiveTiming    },
     { "BD",     PAR_BUFFER_DUMP,       0,  0, OnBufferDump           },
     { "BI",     PAR_BYPASS_INIT,       0,  0, OnSetValueTrue         },
     { "BRD",    PAR_TRY_BRD,           2,  2, OnSetValueInt          },
@@ -542,6 +1025,7 @@ static const DispatchType dispatchTbl[] = {
     { "L1",     PAR_LINEFEED,          0,  0, OnSetValueTrue         },
     { "M0",     PAR_MEMORY,            0,  0, OnSetValueFalse        },
     { "M1",     PAR_MEMORY,            0,  0, OnSetValueTrue         },
+    { "MA",     PAR_MONITOR_ALL,       0,  0, OnMonitorAll           },
     { "NL",     PAR_ALLOW_LONG,        0,  0, OnSetOK                },
     { "PB",     PAR_USER_B,            4,  4, OnSetBytes             },
     { "PC",     PAR_PROTOCOL_CLOSE,    0,  0, OnProtocolClose        },
@@ -550,7 +1034,7 @@ static const DispatchType dispatchTbl[] = {
     { "RA",     PAR_DUMMY,             2,  2, OnSetOK                },
     { "R0",     PAR_RESPONSES,         0,  0, OnSetValueFalse        },
     { "R1",     PAR_RESPONSES,         0,  0, OnSetValueTrue         },
-    { "RTR",    PAR_CAN_SEND_RTR,      0,  0, OnSetOK                },
+    { "RTR",    PAR_CAN_SEND_RTR,      0,  0, OnCanSendRtr           },
     { "RV",     PAR_READ_VOLT,         0,  0, OnReadVoltage          },
     { "S0",     PAR_SPACES,            0,  0, OnSetValueFalse        },
     { "S1",     PAR_SPACES,            0,  0, OnSetValueTrue         },
@@ -578,14 +1062,47 @@ static bool ValidateArgLength(const DispatchType& entry, const string& arg)
     return len >= entry.minParNum && len <= entry.maxParNum;
 }
 
+static const DispatchType stDispatchTbl[] = {
+    { "CFCPA",  PAR_DUMMY,             7, 17, OnCanAddFlowPair       },
+    { "CFCPC",  PAR_DUMMY,             0,  0, OnCanClearFlowPairs    },
+    { "CSEGR1", PAR_DUMMY,             0,  0, OnSetOK                },
+    { "CSEGT1", PAR_DUMMY,             0,  0, OnSetOK                },
+    { "FAB",    PAR_DUMMY,             3, 17, OnCanAddBlockFilter    },
+    { "FAP",    PAR_DUMMY,             3, 17, OnCanAddPassFilter     },
+    { "FCB",    PAR_DUMMY,             0,  0, OnCanClearBlockFilters },
+    { "FCP",    PAR_DUMMY,             0,  0, OnCanClearPassFilters  },
+    { "FLB",    PAR_DUMMY,             0,  0, OnCanListBlockFilters  },
+    { "FLP",    PAR_DUMMY,             0,  0, OnCanListPassFilters   },
+    { "FRP",    PAR_DUMMY,             3, 17, OnCanRemovePassFilter  },
+    { "LBT",    PAR_DUMMY,             0,  0, OnLoopbackTest         },
+    { "LBT",    PAR_DUMMY,             1,  6, OnLoopbackTest         },
+    { "PIDS",   PAR_DUMMY,             2, 40, OnPidBatch             },
+    { "PX",     PAR_DUMMY,             3, 60, OnSendRequestEx        },
+    { "TS0",    PAR_CAN_TIMESTAMP,     0,  0, OnSetValueFalse        },
+    { "TS1",    PAR_CAN_TIMESTAMP,     0,  0, OnSetValueTrue         }
+};
+
+/**
+ * Parse and dispatch ST sequence, the command name is followed by the argument
+ * @param[in] cmdString The user command
+ * @return true if command was dispatched, false otherwise
+ */
 static bool ParseSTCmd(const string& cmdString)
 {
-    if (cmdString == "STCSEGT1" || cmdString == "STCSEGR1" || cmdString == "STCFCPC") {
-        OnSetOK (cmdString, 0);
-        return true;
-    }
-    else if (cmdString.length() == 10 && cmdString.substr(0,7) == "STCFCPA") {
-        OnSetOK (cmdString, 0);
+    // Ignore first two "ST" chars
+    string stcmd = cmdString.substr(2);
+
+    for (const DispatchType& dt : stDispatchTbl) {
+        uint32_t nameLen = strlen(dt.name);
+        if (strncmp(stcmd.c_str(), dt.name, nameLen) != 0)
+            continue;
+
+        string arg = (stcmd.length() > nameLen) ? stcmd.substr(nameLen) : string("");
+        bool valid = (dt.minParNum > 0) ? ValidateArgLength(dt, arg) : arg.empty();
+        if (!valid)
+            continue;
+
+        dt.callback(arg, dt.id);
         return true;
     }
     return false;
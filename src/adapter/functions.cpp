@@ -6,6 +6,7 @@
  */
 
 #include <climits>
+#include <cstdio>
 #include <cortexm.h>
 #include <lstring.h>
 #include <algorithms.h>
@@ -49,21 +50,59 @@ void CanIDToString(uint32_t num, string& str, bool extended)
 }
 
 /**
- * Delay for number of milliseconds using SysTick timer
+ * Format the microsecond timestamp as milliseconds "mmmmm.uuu "
+ * @param[in]  usec The timestamp
+ * @param[out] str The output string
+ */
+void TimestampToString(uint32_t usec, string& str)
+{
+    char out[16];
+    sprintf(out, "%u.%03u ", (usec / 1000), (usec % 1000));
+    str += out;
+}
+
+static volatile bool delayExpired;
+
+extern "C" void SysTick_Handler(void)
+{
+    SysTick->CTRL = 0; // One shot
+    delayExpired = true;
+}
+
+/**
+ * Delay for number of milliseconds using SysTick timer, sleeping in WFI
  * @param[in] value The number of millisecond to delay
  */
 void Delay1ms(uint32_t value)
 {
     if (value == 0) return;
     
-    // Use the SysTick to generate the timeout in msecs
+    uint32_t primask = __get_PRIMASK();
+    
+    // Called with the interrupts disabled, SysTick handler would not run
+    if (primask) {
+        StartDelay1ms(value);
+        while (!(SysTick->CTRL & SysTick_CTRL_COUNTFLAG_Msk)) {
+            ;
+        }
+        SysTick->CTRL = 0;
+        return;
+    }
+    
+    // Use the SysTick interrupt to generate the timeout in msecs
+    delayExpired = false;
     SysTick->LOAD = value * (SystemCoreClock / 1000);
     SysTick->VAL  = 0;
-    SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
-
-    while (!(SysTick->CTRL & 0x10000)) {
-        ;
+    SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk | SysTick_CTRL_ENABLE_Msk;
+
+    // Checked with the interrupts masked, the pending interrupt wakes up WFI
+    __disable_irq();
+    while (!delayExpired) {
+        __WFI();
+        __enable_irq();
+        __disable_irq();
     }
+    __set_PRIMASK(primask);
 }
 
 /**
@@ -0,0 +1,102 @@
+/**
+ * See the file LICENSE for redistribution information.
+ *
+ * Copyright (c) 2009-2016 ObdDiag.Net. All rights reserved.
+ *
+ */
+
+#include <adaptertypes.h>
+#include <Timer.h>
+#include "adaptivetiming.h"
+
+using namespace std;
+
+const uint32_t AT1_MIN_TIMEOUT = 20; // ms, ATAT1 window never goes below
+const uint32_t AT2_MIN_TIMEOUT = 8;  // ms, ATAT2 window never goes below
+
+/**
+ * Forget all the responders, the next request waits the full P2 time
+ */
+void AdaptiveTiming::reset()
+{
+    num_ = 0;
+    active_ = false;
+}
+
+/**
+ * Mark the request end, the latencies count from here
+ */
+void AdaptiveTiming::startRequest()
+{
+    reqTime_ = MicroTimer::now();
+    active_ = true;
+}
+
+/**
+ * Learn the responder latency, the first frame of the response
+ * @param[in] id The responder CAN ID
+ * @param[in] rxTime The frame receive time, usec
+ * @param[in] p2Timeout The regular P2 timeout, ms, the longer latency is dropped
+ */
+void AdaptiveTiming::addSample(uint32_t id, uint32_t rxTime, uint32_t p2Timeout)
+{
+    if (!active_)
+        return;
+    
+    // The stale frame received before the request, or the late one
+    int32_t sample = static_cast<int32_t>(rxTime - reqTime_);
+    if (sample < 0 || static_cast<uint32_t>(sample) > p2Timeout * 1000)
+        return;
+    
+    for (int i = 0; i < num_; i++) {
+        Responder& resp = responders_[i];
+        if (resp.id != id)
+            continue;
+        // avg += (sample - avg) / 8, dev += (|sample - avg| - dev) / 4
+        int32_t diff = sample - static_cast<int32_t>(resp.avg);
+        uint32_t absDiff = (diff < 0) ? -diff : diff;
+        resp.dev = resp.dev - resp.dev / 4 + absDiff / 4;
+        resp.avg = static_cast<uint32_t>(static_cast<int32_t>(resp.avg) + diff / 8);
+        return;
+    }
+    if (num_ < MAX_RESPONDERS) {
+        responders_[num_].id = id;
+        responders_[num_].avg = sample;
+        responders_[num_].dev = sample / 2;
+        num_++;
+    }
+}
+
+/**
+ * Get the receive window, ATAT1 adds four deviations and keeps at least
+ * twice the average, ATAT2 adds two deviations
+ * @param[in] p2Timeout The regular P2 timeout, ms
+ * @return The receive window, ms
+ */
+uint32_t AdaptiveTiming::getTimeout(uint32_t p2Timeout) const
+{
+    const AdapterConfig* config = AdapterConfig::instance();
+    bool aggressive = config->getBoolProperty(PAR_ADPTV_TIM2);
+    
+    if (num_ == 0 || (!aggressive && !config->getBoolProperty(PAR_ADPTV_TIM1)))
+        return p2Timeout; // ATAT0 or nothing learned yet
+    
+    uint32_t window = 0;
+    for (int i = 0; i < num_; i++) {
+        const Responder& resp = responders_[i];
+        uint32_t val = aggressive ? (resp.avg + 2 * resp.dev) : (resp.avg + 4 * resp.dev);
+        if (!aggressive && val < 2 * resp.avg) {
+            val = 2 * resp.avg;
+        }
+        if (val > window) {
+            window = val;
+        }
+    }
+    
+    window = (window + 999) / 1000; // usec -> ms
+    uint32_t minTimeout = aggressive ? AT2_MIN_TIMEOUT : AT1_MIN_TIMEOUT;
+    if (window < minTimeout) {
+        window = minTimeout;
+    }
+    return (window < p2Timeout) ? window : p2Timeout;
+}
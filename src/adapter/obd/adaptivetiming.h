@@ -0,0 +1,42 @@
+/**
+ * See the file LICENSE for redistribution information.
+ *
+ * Copyright (c) 2009-2016 ObdDiag.Net. All rights reserved.
+ *
+ */
+
+#ifndef __ADAPTIVE_TIMING_H__
+#define __ADAPTIVE_TIMING_H__
+
+#include <cstdint>
+
+using namespace std;
+
+//
+// Adaptive response timing, "ATAT1/ATAT2". The response latency is
+// learned per responder CAN ID as the average and the mean deviation,
+// the receive window is shrunk to the slowest responder known
+//
+class AdaptiveTiming {
+public:
+    const static int MAX_RESPONDERS = 4;
+    AdaptiveTiming() { reset(); }
+    void reset();
+    void startRequest();
+    void endRequest() { active_ = false; }
+    bool isActive() const { return active_; }
+    void addSample(uint32_t id, uint32_t rxTime, uint32_t p2Timeout);
+    uint32_t getTimeout(uint32_t p2Timeout) const;
+private:
+    struct Responder {
+        uint32_t id;
+        uint32_t avg; // Average latency, usec
+        uint32_t dev; // Mean deviation, usec
+    };
+    Responder responders_[MAX_RESPONDERS];
+    int       num_;
+    uint32_t  reqTime_; // The request end, usec
+    bool      active_;
+};
+
+#endif //__ADAPTIVE_TIMING_H__
@@ -5,8 +5,25 @@
  *
  */
 
+#include <candriver.h>
 #include "autoadapter.h"
 
+const uint32_t DETECT_WINDOW = 20; // ms for one bit rate
+
+struct AutoEntry {
+    int      adapterType;
+    int      protocol;
+    uint32_t rate;
+};
+
+// The auto search order
+static const AutoEntry CanProtocols[] = {
+    { ADPTR_CAN,     PROT_ISO15765_1150, CAN_BR_500K },
+    { ADPTR_CAN_EXT, PROT_ISO15765_2950, CAN_BR_500K },
+    { ADPTR_CAN,     PROT_ISO15765_1125, CAN_BR_250K },
+    { ADPTR_CAN_EXT, PROT_ISO15765_2925, CAN_BR_250K }
+};
+
 void AutoAdapter::getDescription()
 {
     AdptSendReply("AUTO");
@@ -19,14 +36,29 @@ void AutoAdapter::getDescriptionNum()
     AdptSendReply(reply);
 }
 
-int AutoAdapter::onRequest(const uint8_t* data, int len)
+/**
+ * Monitor with the detected bit rate, 500k 11 bit if the bus is silent
+ * @return The monitoring status
+ */
+int AutoAdapter::monitor()
+{
+    static const uint32_t rates[] = { CAN_BR_500K, CAN_BR_250K };
+    uint32_t rate = CanDriver::instance()->detectBitRate(rates, sizeof(rates) / sizeof(rates[0]), DETECT_WINDOW);
+    
+    ProtocolAdapter* adapter = ProtocolAdapter::getAdapter(ADPTR_CAN);
+    adapter->setProtocol((rate == CAN_BR_250K) ? PROT_ISO15765_1125 : PROT_ISO15765_1150);
+    return adapter->monitor();
+}
+
+int AutoAdapter::onRequest(const uint8_t* data, int len, int numOfResp)
 {
     return REPLY_NO_DATA;
 }
 
-int AutoAdapter::doConnect(int protocol, bool sendReply)
+int AutoAdapter::doConnect(int adapterType, int protocol, bool sendReply)
 {
-    ProtocolAdapter* adapter = ProtocolAdapter::getAdapter(protocol);
+    ProtocolAdapter* adapter = ProtocolAdapter::getAdapter(adapterType);
+    adapter->setProtocol(protocol);
     protocol = adapter->onTryConnectEcu(sendReply);
     sampleSent_ = adapter->isSampleSent();
     if (protocol != 0) {
@@ -38,16 +70,20 @@ int AutoAdapter::doConnect(int protocol, bool sendReply)
     
 int AutoAdapter::onTryConnectEcu(bool sendReply)
 {
-    int protocol = 0;
     connected_ = false;
     sts_ = REPLY_NO_DATA;
     sampleSent_ = false;
-        
-    // CAN
-    protocol = doConnect(ADPTR_CAN, sendReply);
-    if (protocol > 0)
-        return protocol;
-
-    // CAN 29
-    return doConnect(ADPTR_CAN_EXT, sendReply);
+    
+    // Listen first, the request at the wrong bit rate injects the error frames
+    static const uint32_t rates[] = { CAN_BR_500K, CAN_BR_250K };
+    uint32_t rate = CanDriver::instance()->detectBitRate(rates, sizeof(rates) / sizeof(rates[0]), DETECT_WINDOW);
+    
+    for (const AutoEntry& entry : CanProtocols) {
+        if (rate != 0 && rate != entry.rate)
+            continue; // The other bit rate, all are tried if the bus is silent
+        int protocol = doConnect(entry.adapterType, entry.protocol, sendReply);
+        if (protocol > 0)
+            return protocol;
+    }
+    return 0;
 }
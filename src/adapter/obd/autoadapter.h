@@ -15,13 +15,14 @@ public:
     AutoAdapter() { connected_ = false; }
     virtual int onConnectEcu() { return 0; }
     virtual int onTryConnectEcu(bool sendReply);
-    virtual int onRequest(const uint8_t* data, int len);
+    virtual int onRequest(const uint8_t* data, int len, int numOfResp);
     virtual void getDescription();
     virtual void getDescriptionNum();
     virtual int getProtocol() const { return PROT_AUTO; }
     virtual void wiringCheck() {}
+    virtual int monitor();
 private:
-    int doConnect(int protocol, bool sendReply);
+    int doConnect(int adapterType, int protocol, bool sendReply);
 };
 
 #endif //__AUTO_PROFILE_H__
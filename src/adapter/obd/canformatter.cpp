@@ -34,6 +34,40 @@ uint32_t CanReplyFormatter::getConfigKey()
     return key;
 }
 
+/**
+ * Prefix the output line with the frame receive time, if enabled
+ * @param[in] msg CanMsgbuffer instance pointer
+ * @param[out] str The output string
+ */
+void CanReplyFormatter::addTimestamp(const CanMsgBuffer* msg, util::string& str)
+{
+    if (config_->getBoolProperty(PAR_CAN_TIMESTAMP)) {
+        TimestampToString(msg->timestamp, str);
+    }
+}
+
+/**
+ * Remote frame, the header if enabled and "RTR" instead of the data
+ * @param[in] msg CanMsgbuffer instance pointer
+ * @param[out] str The output string
+ * @return true if RTR frame
+ */
+bool CanReplyFormatter::replyRtr(const CanMsgBuffer* msg, util::string& str)
+{
+    if (!msg->rtr)
+        return false;
+    
+    if (config_->getBoolProperty(PAR_HEADER_SHOW)) {
+        CanIDToString(msg->id, str, msg->extended);
+        if (config_->getBoolProperty(PAR_SPACES)) {
+            str += ' ';
+        }
+    }
+    str += "RTR";
+    AdptSendReply(str);
+    return true;
+}
+
 /**
  * Process single frame
  * @param[in] msg CanMsgbuffer instance pointer
@@ -41,6 +75,10 @@ uint32_t CanReplyFormatter::getConfigKey()
 void CanReplyFormatter::reply(const CanMsgBuffer* msg) 
 {
     util::string str;
+    addTimestamp(msg, str);
+    if (replyRtr(msg, str))
+        return;
+
     bool canExtAddr = config_->getBytesProperty(PAR_CAN_EXT)->length;
     uint32_t offst = canExtAddr ? 2 : 1;
     uint32_t dlen = msg->data[offst - 1];
@@ -60,6 +98,47 @@ void CanReplyFormatter::reply(const CanMsgBuffer* msg)
     AdptSendReply(str);
 }
 
+/**
+ * Monitored frame, all the data bytes as received
+ * @param[in] msg CanMsgbuffer instance pointer
+ */
+void CanReplyFormatter::replyMonitor(const CanMsgBuffer* msg)
+{
+    util::string str;
+    addTimestamp(msg, str);
+    if (replyRtr(msg, str))
+        return;
+    uint32_t dlen = (msg->dlc > 8) ? 8 : msg->dlc;
+    
+    if (config_->getBoolProperty(PAR_HEADER_SHOW)) {
+        replyH1(msg, dlen, str);
+    }
+    else {
+        to_ascii(msg->data, dlen, str);
+    }
+    AdptSendReply(str);
+}
+
+/**
+ * Reassembled message bytes, the header if enabled, no PCI
+ * @param[in] id The responder CAN ID
+ * @param[in] extended 29 bit ID flag
+ * @param[in] data The message bytes
+ * @param[in] dlen The number of bytes
+ */
+void CanReplyFormatter::replyData(uint32_t id, bool extended, const uint8_t* data, uint32_t dlen)
+{
+    util::string str;
+    if (config_->getBoolProperty(PAR_HEADER_SHOW)) {
+        CanIDToString(id, str, extended);
+        if (config_->getBoolProperty(PAR_SPACES)) {
+            str += ' ';
+        }
+    }
+    to_ascii(data, dlen, str);
+    AdptSendReply(str);
+}
+
 /**
  * Process first frame
  * @param[in] msg CanMsgbuffer instance pointer
@@ -67,6 +146,7 @@ void CanReplyFormatter::reply(const CanMsgBuffer* msg)
 void CanReplyFormatter::replyFirstFrame(const CanMsgBuffer* msg) 
 {
     util::string str;
+    addTimestamp(msg, str);
     bool canExtAddr = config_->getBytesProperty(PAR_CAN_EXT)->length;
     uint32_t offst = canExtAddr ? 2 : 1;
     uint32_t dlen = canExtAddr ? 5 : 6;
@@ -94,6 +174,7 @@ void CanReplyFormatter::replyFirstFrame(const CanMsgBuffer* msg)
 void CanReplyFormatter::replyNextFrame(const CanMsgBuffer* msg, int num) 
 {
     util::string str;
+    addTimestamp(msg, str);
     bool canExtAddr = config_->getBytesProperty(PAR_CAN_EXT)->length;
     uint32_t offst = canExtAddr ? 2 : 1;
     uint32_t dlen = canExtAddr ? 6 : 7;
@@ -176,7 +257,9 @@ void CanReplyFormatter::replyFirstFrameH0(const CanMsgBuffer* msg, uint32_t offs
 
     CanIDToString(msgLen, str, false); // we need only 3 digits
     AdptSendReply(str);
-    str = "0: ";
+    str.clear();
+    addTimestamp(msg, str);
+    str += "0: ";
     to_ascii((msg->data + offst + 1), dlen, str);
 }
 
@@ -190,6 +273,6 @@ void CanReplyFormatter::replyNextFrameH0(const CanMsgBuffer* msg, uint32_t offst
 {
     char prefix[4]; // space for 1.5 bytes max
     sprintf(prefix, "%X: ", (num & 0x0F));
-    str = prefix;
+    str += prefix;
     to_ascii((msg->data + offst), dlen, str);
 }
@@ -8,6 +8,7 @@
 #include <cstring>
 #include "canhistory.h"
 #include "canmsgbuffer.h"
+#include <Timer.h>
 
 using namespace std;
 using namespace util;
@@ -38,6 +39,7 @@ void CanHistory::dumpCurrentBuffer()
 
     const int pos2 = pos1 + 3;
     const int pos3 = pos2 + 3;
+    bool showTime = AdapterConfig::instance()->getBoolProperty(PAR_CAN_TIMESTAMP);
     string out;
     
     do {
@@ -51,6 +53,10 @@ void CanHistory::dumpCurrentBuffer()
         to_ascii(msglog_[i].data, 8, out);
         out += "  -> ";
         to_ascii(&msglog_[i].mid, 1, out);
+        if (showTime) {
+            out += " @";
+            TimestampToString(msglog_[i].timestamp, out);
+        }
         
         AdptSendReply(out);
         // Advance the position
@@ -74,6 +80,7 @@ void CanHistory::add2Buffer(const CanMsgBuffer* buff, bool dir, uint8_t mid)
     msglog_[i].dlc = buff->dlc;
     memcpy(msglog_[i].data, buff->data, sizeof(buff->data));
     msglog_[i].mid = mid;
+    msglog_[i].timestamp = dir ? MicroTimer::now() : buff->timestamp;
 
     if (currMsgPos_ >= HISTORY_LEN) { // curMsgPos = [0...15]
         currMsgPos_ = 0;
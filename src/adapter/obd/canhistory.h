@@ -13,7 +13,7 @@
 using namespace util;
 
 struct MsgEntry {
-	MsgEntry() : id(0), dir(false), ext(false), dlc(0), mid(0)
+	MsgEntry() : id(0), dir(false), ext(false), dlc(0), mid(0), timestamp(0)
 	{
 		memset(data, 0, sizeof(data));
 	}
@@ -23,6 +23,7 @@ struct MsgEntry {
     uint8_t dlc;
     uint8_t mid;
     uint8_t data[8];
+    uint32_t timestamp;
 };
 
 struct CanMsgBuffer;
@@ -10,18 +10,37 @@
 #include <adaptertypes.h>
 #include <Timer.h>
 #include <candriver.h>
+#include <CanFilter.h>
 #include <led.h>
 #include "canmsgbuffer.h"
 #include <algorithms.h>
 #include "obdprofile.h"
 #include "j1979.h"
 #include "isocan.h"
+#include "adaptivetiming.h"
 #include "canhistory.h"
 
 using namespace std;
 using namespace util;
 
 const int CAN_FRAME_LEN = 8;
+const int TEC_FAIL_STEP = 16;  // Two failed transmissions, 8 each
+const int TEC_PASSIVE   = 128; // Error passive, ACK errors do not count anymore
+const uint32_t TX_PENDING_MAX = 100000; // us, error passive frame not going out
+const int HOLD_FRAME_NUM = 4;   // Frames of the other responders held while one is printed
+const int PID_RESP_LEN   = 48;  // Batched Mode 01 response, six PIDs with the usual lengths
+
+// The held frames, shared by the CAN adapters as only one is active
+static CanMsgBuffer HeldFrames[HOLD_FRAME_NUM];
+static int HeldNum;
+
+// The responder reassembly contexts and the learned response timing, shared the same way
+static IsoTpContextTable RxCtx;
+static AdaptiveTiming Timing;
+
+// Mode 01 supported PIDs 01-FF, 0100/0120/... bits, and the ranges of 32 PIDs queried since open
+static uint8_t PidMap[32];
+static uint8_t PidMapLoaded;
 
 IsoCanAdapter::IsoCanAdapter()
 {
@@ -30,6 +49,12 @@ IsoCanAdapter::IsoCanAdapter()
     history_    = new CanHistory();
     sts_        = REPLY_NO_DATA;
     canExtAddr_ = false;
+    txErrors_   = 0;
+    rxOverflows_= 0;
+    txPendStart_= 0;
+    txPendWatch_= false;
+    owner_      = nullptr;
+    txStopped_  = false;
     formatter_  = new CanReplyFormatter();
 }
 
@@ -44,8 +69,10 @@ bool IsoCanAdapter::sendToEcu(const uint8_t* buff, int length)
     uint8_t dlc = 0;
     uint8_t data[CAN_FRAME_LEN] = {0};
     
+    txStopped_ = false;
     if (length > 0x0FFF)
         return false; // The max CAN length
+    saveBusState();
 
     bool caf1Option = config_->getBoolProperty(PAR_CAN_CAF);
     
@@ -65,7 +92,7 @@ bool IsoCanAdapter::sendToEcu(const uint8_t* buff, int length)
 
         // OBD type format with dlc=8, and first byte = length
         //
-        dlc = (getProtocol() != PROT_ISO15765_USR_B) ? CAN_FRAME_LEN : totalLen;
+        dlc = isVariableDlc() ? totalLen : CAN_FRAME_LEN;
         
         // If CAF1
         if (caf1Option) {
@@ -102,74 +129,77 @@ bool IsoCanAdapter::sendFrameToEcu(const uint8_t* data, uint8_t length, uint8_t
 }
 
 /**
- * Send CAN multi frames CAN to ECU
+ * Send CAN multi frames CAN to ECU, the consecutive frames go out from
+ * the transmit interrupt, the user could stop the transfer
  * @param[in] data The message data bytes
  * @param[in] length The message length
  * @return true if OK, false if data issues
  */
 bool IsoCanAdapter::sendToEcuMF(const uint8_t* buff, int length)
 {
-    int idx = 0;
-    uint8_t dlc = 0;
-    uint8_t data[CAN_FRAME_LEN] = {0};
     const ByteArray* canExt = config_->getBytesProperty(PAR_CAN_EXT);
+    IsoTpSender* sender = IsoTpSender::instance();
+    CanMsgBuffer msgBuffer;
+    int logged = 0;
     
-    // First frame
-    //
-    dlc = 8; // Its a first frame anyway
-    if (canExtAddr_)
-        data[idx++] = canExt->data[0];
-    data[idx] = 0x10; // First frame indicator
-    data[idx++] |= (length & 0xF00) >> 8; // Maximum 4095 bytes, 1.5 byte len
-    data[idx++] = length & 0xFF;  
-    int numBytesSent = canExtAddr_ ? 5 : 6;
-    memcpy(data + idx, buff, numBytesSent);
-    if (!sendFrameToEcu(data, dlc, dlc))
+    if (!sender->start(getID(), extended_, canExtAddr_, canExt->data[0], buff, length)) {
+        sender->close();
         return false;
+    }
     
-    // Wait for control frame
-    //
-    uint8_t fs, bs, stmin;
-    if (!receiveControlFrame(fs, bs, stmin))
-        return false; // error getting control frame
-    if (fs != 0) 
-        return false; // the destination is not ready
-    uint32_t frameDelay = stmin;
-    
-    // The rest of frames
-    //
-    const int frameDataLen = canExtAddr_ ? 6 : 7;
-    int restFrameNum = (length - numBytesSent) / frameDataLen;
-    if ((length - numBytesSent) % frameDataLen)
-        restFrameNum++;
-    
-    uint8_t sn = 0x21; // The SN start with the one
-    for (int i = 0; i < restFrameNum; i++) {
-        int numBytesLeft = length - numBytesSent;
-        uint8_t numToSend = (numBytesLeft > frameDataLen) ? frameDataLen : numBytesLeft;
-        
-        idx = 0;
-        if (canExtAddr_)
-            data[idx++] = canExt->data[0];
-        data[idx++] = sn++;
-        dlc = idx + numToSend;
-        memcpy(data + idx, buff + numBytesSent, numToSend);
-        // In some cases dlc is always 8 ?
-        if (!sendFrameToEcu(data, dlc, dlc))
-            return false;
-        
-        numBytesSent += numToSend;
+    Timer* timer = Timer::instance(0);
+    AdptWatchUserBreak(true);
+    while (sender->isBusy()) {
+        // Message log
+        for (; logged < sender->getQueued(); logged++) {
+            sender->getFrame(logged, &msgBuffer);
+            history_->add2Buffer(&msgBuffer, true, 0);
+        }
+        if (AdptUserBreak()) {
+            txStopped_ = true;
+            sender->abort();
+            break;
+        }
+        if (sender->isTimedOut() || checkBusErrors()) {
+            sender->abort();
+            break;
+        }
         
-        // SN rollover
-        if (sn > 0x2F) 
-            sn = 0x20;
+        // The flow control frames, the rest is dropped
+        int count = 0;
+        const CanMsgBuffer* msgs = driver_->peek(count);
+        for (int i = 0; i < count; i++) {
+            const CanMsgBuffer* msg = &msgs[i];
+            history_->add2Buffer(msg, false, msg->msgnum);
+            const uint8_t* pci = canExtAddr_ ? &msg->data[1] : &msg->data[0];
+            if ((pci[0] & 0xF0) == 0x30) {
+                sender->onFlowControl(pci[0] & 0x0F, pci[1], pci[2]);
+            }
+        }
+        driver_->consume(count);
         
-        // frame delay
-        if (frameDelay > 0)
-            Delay1ms(frameDelay);
+        if (sender->isPacing()) {
+            sender->poll();
+            // STmin F1-F9 is less than a millisecond, busy wait only for these,
+            // the transmit complete interrupt wakes up as well
+            uint32_t paceTime = sender->getPaceTime();
+            if (paceTime >= 1000 && count == 0) {
+                timer->start(paceTime / 1000);
+                waitForFrame(timer);
+            }
+        }
+        else if (count == 0) {
+            timer->start(1); // Wake up to check the timeouts
+            waitForFrame(timer);
+        }
     }
-    
-    return true;
+    for (; logged < sender->getQueued(); logged++) {
+        sender->getFrame(logged, &msgBuffer);
+        history_->add2Buffer(&msgBuffer, true, 0);
+    }
+    AdptWatchUserBreak(false);
+    sender->close();
+    return sender->getState() == ISOTP_TX_DONE;
 }
 
 /**
@@ -188,125 +218,637 @@ bool IsoCanAdapter::checkResponsePending(const CanMsgBuffer* msg)
     return false;
 }
 
+/**
+ * Keep the error and overflow counters at the request start
+ */
+void IsoCanAdapter::saveBusState()
+{
+    txErrors_ = driver_->getTxErrorCount();
+    rxOverflows_ = driver_->getOverflowCount();
+    txPendWatch_ = false;
+}
+
+/**
+ * Fast failure on the bus problems, the request is not waiting for P2 timeout
+ * @return 0 if OK, REPLY_BUS_ERROR on bus-off, REPLY_CAN_ERROR if the transmission fails,
+ *         REPLY_BUFFER_FULL if the received frames were lost
+ */
+int IsoCanAdapter::checkBusErrors()
+{
+    int sts = 0;
+    uint8_t tec = driver_->getTxErrorCount();
+    
+    if (driver_->getOverflowCount() != rxOverflows_) {
+        return REPLY_BUFFER_FULL;
+    }
+    if (driver_->isBusOff()) {
+        sts = REPLY_BUS_ERROR;
+    }
+    else if (tec >= txErrors_ + TEC_FAIL_STEP || isTxStuck(tec)) {
+        sts = REPLY_CAN_ERROR;
+    }
+    if (sts) {
+        driver_->abortTx();
+    }
+    return sts;
+}
+
+/**
+ * Error passive controller gets no TEC rise on ACK errors, the frame nobody
+ * acknowledges is retried forever. Fail if it is pending for too long
+ * @param[in] tec The transmit error counter
+ * @return true if the frame has not gone out in TX_PENDING_MAX
+ */
+bool IsoCanAdapter::isTxStuck(uint8_t tec)
+{
+    if (tec < TEC_PASSIVE || !driver_->isTxPending()) {
+        txPendWatch_ = false;
+        return false;
+    }
+    if (!txPendWatch_) {
+        txPendWatch_ = true;
+        txPendStart_ = MicroTimer::now();
+        return false;
+    }
+    return MicroTimer::elapsed(txPendStart_) > TX_PENDING_MAX;
+}
+
+/**
+ * Check the request addressing, the functional one could have several responders
+ * @return true if physical, false if functional (7DF or 18DB33F1)
+ */
+bool IsoCanAdapter::isPhysicalRequest() const
+{
+    uint32_t id = getID();
+    return extended_ ? ((id & 0x00FF0000) != 0x00DB0000) : (id != 0x7DF);
+}
+
+/**
+ * Send the flow control frame for the first frame or the next block,
+ * ATFCSM/ATFCSH/ATFCSD and STCFCPA pairs are applied
+ * @param[in] msg The ECU frame to answer
+ * @param[in] id The automatic flow control frame ID
+ * @return The block size granted, 0 if no more flow control frames expected
+ */
+uint8_t IsoCanAdapter::sendFlowFrame(const CanMsgBuffer* msg, uint32_t id)
+{
+    if (!config_->getBoolProperty(PAR_CAN_FLOW_CONTROL))
+        return 0; // ATCFC0
+    
+    int flowMode = config_->getIntProperty(PAR_CAN_FLOW_CTRL_MD);
+    const ByteArray* hdr = config_->getBytesProperty(PAR_CAN_FLOW_CTRL_HDR);
+    const ByteArray* bytes = config_->getBytesProperty(PAR_CAN_FLOW_CTRL_DAT);
+    
+    FlowControlTable::instance()->find(msg->id, extended_, id);
+    if (flowMode == 1) {
+        id = hdr->asCanId() & (extended_ ? 0x1FFFFFFF : 0x7FF);
+    }
+    
+    // Default "30 00 00", no blocks and no delay
+    CanMsgBuffer ctrlData(id, extended_, 8, 0x30);
+    int offst = 0;
+    if (flowMode > 0) {
+        memcpy(ctrlData.data, bytes->data, bytes->length);
+        offst = canExtAddr_ ? 1 : 0; // The user data include the address byte
+    }
+    else if (canExtAddr_) {
+        ctrlData.data[0] = config_->getBytesProperty(PAR_CAN_EXT)->data[0];
+        ctrlData.data[1] = 0x30;
+        offst = 1;
+    }
+    driver_->send(&ctrlData);
+    
+    // Message log
+    history_->add2Buffer(&ctrlData, true, 0);
+    
+    return ((ctrlData.data[offst] & 0xF0) == 0x30) ? ctrlData.data[offst + 1] : 0;
+}
+
+/**
+ * Print the received frame
+ * @param[in] msg CanMsgbuffer instance pointer
+ * @param[in] ctx The responder context, could be nullptr
+ */
+void IsoCanAdapter::replyFrame(const CanMsgBuffer* msg, IsoTpContext* ctx)
+{
+    // CAN extextended address
+    uint8_t keyByte = canExtAddr_ ? msg->data[1] : msg->data[0];
+    switch ((keyByte & 0xF0) >> 4) {
+        case CANSingleFrame:
+            formatter_->reply(msg);
+            break;
+        case CANFirstFrame:
+            formatter_->replyFirstFrame(msg);
+            if (ctx)
+                ctx->lineNum = 0;
+            break;
+        case CANConsecutiveFrame:
+            formatter_->replyNextFrame(msg, ctx ? ++ctx->lineNum : 0);
+            break;
+        default:
+            formatter_->reply(msg); // oops
+    }
+}
+
+/**
+ * Print the frame or hold it while the other responder message is printed,
+ * the output goes grouped by responder
+ * @param[in] msg CanMsgbuffer instance pointer
+ * @param[in] ctx The responder context, could be nullptr
+ */
+void IsoCanAdapter::holdFrame(const CanMsgBuffer* msg, IsoTpContext* ctx)
+{
+    bool hold = owner_ && owner_ != ctx && owner_->rx.isReceiving();
+    if (hold && HeldNum == HOLD_FRAME_NUM) {
+        releaseFrames(true); // No room, print as is
+        hold = false;
+    }
+    if (hold) {
+        HeldFrames[HeldNum++] = *msg;
+        return;
+    }
+    
+    replyFrame(msg, ctx);
+    if (ctx && ctx->rx.isReceiving()) {
+        owner_ = ctx;
+    }
+    else if (owner_ == ctx) {
+        owner_ = nullptr;
+        releaseFrames(false); // The message is over, print the next responder
+    }
+}
+
+/**
+ * Print the held frames responder by responder, in the arrival order
+ * @param[in] all Print all if true, otherwise stop at the responder which
+ *                message is not over, it becomes the printed one
+ */
+void IsoCanAdapter::releaseFrames(bool all)
+{
+    if (all) {
+        owner_ = nullptr;
+    }
+    while (HeldNum > 0) {
+        uint32_t id = HeldFrames[0].id;
+        IsoTpContext* ctx = RxCtx.get(id);
+        int num = 0;
+        for (int i = 0; i < HeldNum; i++) {
+            if (HeldFrames[i].id == id) {
+                replyFrame(&HeldFrames[i], ctx);
+            }
+            else {
+                HeldFrames[num++] = HeldFrames[i];
+            }
+        }
+        HeldNum = num;
+        if (!all && ctx && ctx->rx.isReceiving()) {
+            owner_ = ctx;
+            break;
+        }
+    }
+}
+
+/**
+ * Sleep until a frame is received or the timer expires. The other interrupts,
+ * UART or CAN errors, wake up as well
+ * @param[in] timer The timeout timer
+ */
+void IsoCanAdapter::waitForFrame(const Timer* timer)
+{
+    // Checked with the interrupts masked, the pending interrupt wakes up WFI
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (!driver_->isReady() && !timer->isExpired()) {
+        __WFI();
+    }
+    __set_PRIMASK(primask);
+}
+
 /**
  * Receives a sequence of bytes from the CAN bus
  * @param[in] sendReply send reply to user flag
- * @return true if message received, false otherwise
+ * @param[in] numOfResp The number of responses to wait for, 0 if unknown
+ * @return REPLY_OK if message received, REPLY_NO_DATA if not, or the bus error code
  */
-bool IsoCanAdapter::receiveFromEcu(bool sendReply)
+int IsoCanAdapter::receiveFromEcu(bool sendReply, int numOfResp)
 {
     const int MAX_PEND_RESP_NUM = 100;
     int pendRespCounter = 0;
     const int p2Timeout = getP2MaxTimeout();
-    CanMsgBuffer msgBuffer;
     bool msgReceived = false;
+    bool completed = false;
+    int respNum = 0;
+    
+    // ATAT1/ATAT2, the window learned from the previous responses
+    int window = Timing.isActive() ? Timing.getTimeout(p2Timeout) : p2Timeout;
     canExtAddr_ = config_->getBytesProperty(PAR_CAN_EXT)->length; // set class instance member
-    int frameNum = 0;
+    
+    // Only one ECU answers the physical request, no need to wait for P2 after its message
+    bool caf1Option = config_->getBoolProperty(PAR_CAN_CAF);
+    bool finishEarly = caf1Option && isPhysicalRequest();
+    RxCtx.reset();
+    owner_ = nullptr;
+    HeldNum = 0;
     
     Timer* timer = Timer::instance(0);
-    timer->start(p2Timeout);
+    timer->start(window);
 
     do {
-        if (!driver_->isReady())
-            continue;
-        driver_->read(&msgBuffer);
-        
-        // Message log
-        history_->add2Buffer(&msgBuffer, false, msgBuffer.msgnum);
-        
-        if (!checkResponsePending(&msgBuffer) || pendRespCounter > MAX_PEND_RESP_NUM) {
-            // Reload the timer, regular P2 timeout
-            timer->start(p2Timeout);
-        }
-        else {
-            // Reload the timer, P2* timeout
-            timer->start(P2_MAX_TIMEOUT_S);
-            pendRespCounter++;
+        int sts = checkBusErrors();
+        if (sts) {
+            if (sendReply)
+                releaseFrames(true);
+            Timing.endRequest();
+            return sts;
         }
         
-        // Check the CAN receiver address
-        /*
-        if (canExt) {
-            if (msgBuffer.data[0] != testerAddress)
+        // The ready frames are processed in the ring slots and released at once
+        int count = 0;
+        const CanMsgBuffer* msgs = driver_->peek(count);
+        for (int i = 0; i < count; i++) {
+            const CanMsgBuffer* msg = &msgs[i];
+            
+            // Message log
+            history_->add2Buffer(msg, false, msg->msgnum);
+            
+            bool responsePending = checkResponsePending(msg);
+            
+            // Learn the latency from the first frame of the response
+            uint8_t pciType = (canExtAddr_ ? msg->data[1] : msg->data[0]) >> 4;
+            if (!responsePending && pendRespCounter == 0 && pciType <= CANFirstFrame) {
+                Timing.addSample(msg->id, msg->timestamp, p2Timeout);
+            }
+            
+            msgReceived = true;
+            IsoTpContext* ctx = RxCtx.get(msg->id);
+            int event = ctx ? ctx->rx.onFrame(msg, canExtAddr_) : ISOTP_UNEXPECTED;
+            
+            if (!responsePending || pendRespCounter > MAX_PEND_RESP_NUM) {
+                // Reload the timer, regular P2 timeout or the adaptive one,
+                // the learned time does not apply to the consecutive frames
+                timer->start(RxCtx.isReceiving() ? p2Timeout : window);
+            }
+            else {
+                // Reload the timer, P2* timeout
+                timer->start(P2_MAX_TIMEOUT_S);
+                pendRespCounter++;
+            }
+            // The message is over, CAF0 has no messages, just frames
+            if ((event == ISOTP_COMPLETE || !caf1Option) && !responsePending) {
+                respNum++;
+                if (finishEarly || respNum == numOfResp) {
+                    completed = true;
+                }
+            }
+            if (!sendReply)
                 continue;
-        }*/
-
-        msgReceived = true;
-        if (!sendReply)
-            continue;
+            
+            // The flow control goes to the sender at once, the printing could wait
+            if (event == ISOTP_FIRST) {
+                ctx->blockSize = processFlowFrame(msg);
+                ctx->blockCnt = 0;
+            }
+            else if (event == ISOTP_NEXT && ctx->blockSize && ++ctx->blockCnt == ctx->blockSize) {
+                ctx->blockSize = processFlowFrame(msg); // The block is over, let the ECU send the next one
+                ctx->blockCnt = 0;
+            }
+            holdFrame(msg, ctx);
+            if (event == ISOTP_SEQ_ERROR) {
+                AdptSendReply("<RX ERROR"); // The consecutive frame is missing
+            }
+        }
+        driver_->consume(count);
+        if (completed)
+            break;
+        if (count == 0) {
+            waitForFrame(timer);
+        }
         
-        // CAN extextended address
-        uint8_t keyByte = canExtAddr_ ? msgBuffer.data[1] : msgBuffer.data[0];
-        switch ((keyByte & 0xF0) >> 4) {
-            case CANSingleFrame:
-                formatter_->reply(&msgBuffer); //processFrame(&msgBuffer);
-                break;
-            case CANFirstFrame:
-                processFlowFrame(&msgBuffer);
-                formatter_->replyFirstFrame(&msgBuffer);//processFirstFrame(&msgBuffer);
-                break;
-            case CANConsecutiveFrame:
-                formatter_->replyNextFrame(&msgBuffer, ++frameNum);//processNextFrame(&msgBuffer, ++frameNum);
-                break;
-            default:
-                formatter_->reply(&msgBuffer); //processFrame(&msgBuffer); // oops
+        // The response missed the adaptive window, fall back to P2 and relearn
+        if (timer->isExpired() && !msgReceived && window < p2Timeout) {
+            Timing.reset();
+            timer->start(p2Timeout - window);
+            window = p2Timeout;
         }
     } while (!timer->isExpired());
 
-    return msgReceived;
+    // The message cut off or the responses missing, the next request gets full P2
+    if (!completed && (RxCtx.isReceiving() || respNum < numOfResp)) {
+        Timing.reset();
+    }
+    Timing.endRequest();
+    if (sendReply) {
+        releaseFrames(true);
+        if (RxCtx.isReceiving()) {
+            AdptSendReply("<RX ERROR"); // The last frames have not arrived
+        }
+    }
+    return msgReceived ? REPLY_OK : REPLY_NO_DATA;
 }
 
-bool IsoCanAdapter::receiveControlFrame(uint8_t& fs, uint8_t& bs, uint8_t& stmin)
+int IsoCanAdapter::getP2MaxTimeout() const
 {
+    int p2Timeout = config_->getIntProperty(PAR_TIMEOUT);
+    int p2Mult = config_->getIntProperty(PAR_CAN_TIMEOUT_MULT);
+    return p2Timeout ? (p2Timeout * 4 * p2Mult) : P2_MAX_TIMEOUT;
+}
+
+/**
+ * Global entry ECU send/receive function
+ * @param[in] data The message data bytes
+ * @param[in] len The message length
+ * @return The completion status code
+ */
+int IsoCanAdapter::onRequest(const uint8_t* data, int len, int numOfResp)
+{
+    if (!sendToEcu(data, len)) {
+        if (txStopped_)
+            return REPLY_STOPPED;
+        int sts = checkBusErrors();
+        return sts ? sts : REPLY_DATA_ERROR;
+    }
+    Timing.startRequest();
+    int sts = receiveFromEcu(true, numOfResp);
+    return (sts == REPLY_OK) ? REPLY_NONE : sts;
+}
+
+/**
+ * Send the remote frame with the current header and wait for the responses
+ * @return The completion status code
+ */
+int IsoCanAdapter::sendRtr()
+{
+    CanMsgBuffer msgBuffer(getID(), extended_, 0, 0);
+    msgBuffer.rtr = true;
+    
+    if (!connected_) {
+        open();
+    }
+    saveBusState();
+    
+    // Message log
+    history_->add2Buffer(&msgBuffer, true, 0);
+    
+    if (!driver_->send(&msgBuffer))
+        return REPLY_DATA_ERROR;
+    int sts = receiveFromEcu(true);
+    return (sts == REPLY_OK) ? REPLY_NONE : sts;
+}
+
+/**
+ * Send the request and keep the message of the first responder, the multi-frame
+ * response is reassembled to the buffer, nothing is printed
+ * @param[in] data The request bytes
+ * @param[in] len The request length
+ * @param[out] resp The response message bytes, truncated to the buffer size
+ * @param[in,out] respLen The buffer size, the message length on return
+ * @param[out] respId The responder CAN ID
+ * @return REPLY_OK if the message received, REPLY_NO_DATA if not, or the error code
+ */
+int IsoCanAdapter::requestData(const uint8_t* data, int len, uint8_t* resp, int& respLen, uint32_t& respId)
+{
+    const int MAX_PEND_RESP_NUM = 100;
+    int pendRespCounter = 0;
     const int p2Timeout = getP2MaxTimeout();
-    CanMsgBuffer msgBuffer;
+    const uint32_t maxLen = respLen;
+    IsoTpReceiver rx;
+    bool locked = false;
+    bool completed = false;
+    uint8_t blockSize = 0;
+    uint8_t blockCnt = 0;
+    int sts = 0;
+    
+    respLen = 0;
+    if (!sendToEcu(data, len)) {
+        if (txStopped_)
+            return REPLY_STOPPED;
+        sts = checkBusErrors();
+        return sts ? sts : REPLY_DATA_ERROR;
+    }
+    Timing.startRequest();
+    
+    int window = Timing.isActive() ? Timing.getTimeout(p2Timeout) : p2Timeout;
+    // The functional request could get the other responders, let them finish
+    bool finishEarly = isPhysicalRequest();
     
     Timer* timer = Timer::instance(0);
-    timer->start(p2Timeout);
-
+    timer->start(window);
+    
     do {
-        if (!driver_->isReady())
-            continue;
-        driver_->read(&msgBuffer);
+        sts = checkBusErrors();
+        if (sts)
+            break;
         
-        // Message log
-        history_->add2Buffer(&msgBuffer, false, msgBuffer.msgnum);
-
-        if (!canExtAddr_ && (msgBuffer.data[0] & 0xF0) == 0x30) {
-            fs = msgBuffer.data[0] & 0x0F;
-            bs = msgBuffer.data[1];
-            stmin = msgBuffer.data[2];
-            return true;
+        int count = 0;
+        const CanMsgBuffer* msgs = driver_->peek(count);
+        for (int i = 0; i < count && !sts; i++) {
+            const CanMsgBuffer* msg = &msgs[i];
+            
+            // Message log
+            history_->add2Buffer(msg, false, msg->msgnum);
+            if (completed || (locked && msg->id != respId))
+                continue; // The other responders
+            
+            if (checkResponsePending(msg) && pendRespCounter <= MAX_PEND_RESP_NUM) {
+                timer->start(P2_MAX_TIMEOUT_S);
+                pendRespCounter++;
+                continue;
+            }
+            
+            const uint8_t* pci = canExtAddr_ ? &msg->data[1] : &msg->data[0];
+            uint8_t pciType = pci[0] >> 4;
+            uint32_t pos = rx.getReceived();
+            uint32_t num = 0;
+            const uint8_t* src = pci + 1;
+            
+            switch (rx.onFrame(msg, canExtAddr_)) {
+                case ISOTP_FIRST:
+                    pos = 0;
+                    num = rx.getReceived();
+                    src = pci + 2; // 1.5 bytes length
+                    blockSize = processFlowFrame(msg);
+                    blockCnt = 0;
+                    break;
+                case ISOTP_NEXT:
+                    num = rx.getReceived() - pos;
+                    if (blockSize && ++blockCnt == blockSize) {
+                        blockSize = processFlowFrame(msg);
+                        blockCnt = 0;
+                    }
+                    break;
+                case ISOTP_COMPLETE:
+                    if (pciType == CANSingleFrame) {
+                        pos = 0;
+                        num = pci[0] & 0x0F;
+                    }
+                    else {
+                        num = rx.getLength() - pos; // The last frame is padded
+                    }
+                    completed = true;
+                    break;
+                case ISOTP_SEQ_ERROR:
+                    sts = REPLY_DATA_ERROR; // The consecutive frame is missing
+                    continue;
+                default:
+                    continue; // Flow control or the unexpected frame
+            }
+            
+            // Learn the latency from the first frame of the response
+            if (!locked && pendRespCounter == 0) {
+                Timing.addSample(msg->id, msg->timestamp, p2Timeout);
+            }
+            locked = true;
+            respId = msg->id;
+            // The learned time does not apply to the consecutive frames
+            timer->start(rx.isReceiving() ? p2Timeout : window);
+            if (pos < maxLen) {
+                num = (pos + num > maxLen) ? (maxLen - pos) : num;
+                memcpy(resp + pos, src, num);
+                respLen = pos + num;
+            }
         }
-        else if (canExtAddr_ && (msgBuffer.data[1] & 0xF0) == 0x30) {
-            fs = msgBuffer.data[1] & 0x0F;
-            bs = msgBuffer.data[2];
-            stmin = msgBuffer.data[3];
-            return true;
+        driver_->consume(count);
+        if (sts || (completed && finishEarly))
+            break;
+        if (count == 0) {
+            waitForFrame(timer);
+        }
+        
+        // The response missed the adaptive window, fall back to P2 and relearn
+        if (timer->isExpired() && !locked && window < p2Timeout) {
+            Timing.reset();
+            timer->start(p2Timeout - window);
+            window = p2Timeout;
         }
     } while (!timer->isExpired());
+    
+    // The message cut off, the next request gets full P2
+    if (!sts && rx.isReceiving()) {
+        Timing.reset();
+    }
+    Timing.endRequest();
+    if (sts)
+        return sts;
+    return completed ? REPLY_OK : REPLY_NO_DATA;
+}
 
-    return false;
+/**
+ * Check the PID in the supported PIDs of the first responder, the bitmap
+ * is queried once per 32 PIDs range with 0100, 0120, ... until the adapter reopens
+ * @param[in] pid The Mode 01 PID
+ * @return true if supported
+ */
+bool IsoCanAdapter::isPidSupported(uint8_t pid)
+{
+    if (pid == 0)
+        return true; // Always supported
+    
+    int range = (pid - 1) >> 5;
+    uint8_t* bits = &PidMap[range * 4];
+    if (!(PidMapLoaded & (1 << range))) {
+        uint8_t base = range << 5;
+        memset(bits, 0, 4);
+        // The range is not queried if the previous range says it is not supported
+        if (base == 0 || isPidSupported(base)) {
+            uint8_t req[] = { 0x01, base };
+            uint8_t resp[8];
+            int respLen = sizeof(resp);
+            uint32_t id;
+            int sts = requestData(req, sizeof(req), resp, respLen, id);
+            if (sts != REPLY_OK && sts != REPLY_NO_DATA)
+                return false; // Bus problems, ask again the next time
+            if (sts == REPLY_OK && respLen >= 6 && resp[0] == 0x41 && resp[1] == base) {
+                memcpy(bits, resp + 2, 4);
+            }
+        }
+        PidMapLoaded |= (1 << range);
+    }
+    int bit = (pid - 1) & 0x1F;
+    return bits[bit >> 3] & (0x80 >> (bit & 7));
 }
 
-int IsoCanAdapter::getP2MaxTimeout() const
+/**
+ * Split the batched Mode 01 response, one "41 PID data" line per PID
+ * @param[in] resp The response message, modified
+ * @param[in] len The response length
+ * @param[in] id The responder CAN ID
+ * @return The number of lines printed
+ */
+int IsoCanAdapter::replyPids(uint8_t* resp, int len, uint32_t id)
 {
-    int p2Timeout = config_->getIntProperty(PAR_TIMEOUT);
-    int p2Mult = config_->getIntProperty(PAR_CAN_TIMEOUT_MULT);
-    return p2Timeout ? (p2Timeout * 4 * p2Mult) : P2_MAX_TIMEOUT;
+    if (resp[0] != 0x41) {
+        formatter_->replyData(id, extended_, resp, len); // Negative response as is
+        return 1;
+    }
+    
+    int lines = 0;
+    int pos = 1;
+    while (pos < len) {
+        int dlen = GetPidDataLength(resp[pos]);
+        if (dlen == 0 || (pos + 1 + dlen) > len) {
+            dlen = len - pos - 1; // Unknown PID goes alone, the rest is its data
+        }
+        // The byte before the PID is already printed, the service byte goes there
+        resp[pos - 1] = 0x41;
+        formatter_->replyData(id, extended_, resp + pos - 1, dlen + 2);
+        pos += dlen + 1;
+        lines++;
+    }
+    return lines;
 }
 
 /**
- * Global entry ECU send/receive function
- * @param[in] data The message data bytes
- * @param[in] len The message length
- * @return The completion status code
+ * Mode 01 request of the PID list, the supported PIDs go up to six in one
+ * request and the combined response is split back per PID. The unsupported
+ * PIDs are skipped, only the first responder is used
+ * @param[in] pids The PIDs
+ * @param[in] num The number of PIDs
+ * @return REPLY_NONE if any PID replied, REPLY_NO_DATA if none, or the error code
  */
-int IsoCanAdapter::onRequest(const uint8_t* data, int len)
+int IsoCanAdapter::batchPids(const uint8_t* pids, int num)
 {
-    if (!sendToEcu(data, len))
-        return REPLY_DATA_ERROR;
-    return receiveFromEcu(true) ? REPLY_NONE : REPLY_NO_DATA;
+    uint8_t req[MAX_PIDS_PER_REQUEST + 1] = { 0x01 };
+    uint8_t resp[PID_RESP_LEN];
+    int lines = 0;
+    
+    if (!config_->getBoolProperty(PAR_CAN_CAF))
+        return REPLY_CMD_WRONG; // The response length is in PCI byte
+    if (!connected_) {
+        open();
+    }
+    
+    int i = 0;
+    while (i < num) {
+        int reqLen = 1;
+        int respMax = 1;
+        while (i < num && reqLen <= MAX_PIDS_PER_REQUEST) {
+            uint8_t pid = pids[i];
+            int dlen = GetPidDataLength(pid);
+            if (!isPidSupported(pid)) {
+                i++;
+                continue;
+            }
+            if ((dlen == 0 && reqLen > 1) || (respMax + dlen + 1) > PID_RESP_LEN)
+                break; // The next request
+            req[reqLen++] = pid;
+            respMax += dlen + 1;
+            i++;
+            if (dlen == 0)
+                break; // The unknown length PID goes alone
+        }
+        if (reqLen == 1)
+            continue;
+        
+        int respLen = sizeof(resp);
+        uint32_t id;
+        int sts = requestData(req, reqLen, resp, respLen, id);
+        if (sts == REPLY_NO_DATA)
+            continue;
+        if (sts != REPLY_OK)
+            return sts;
+        lines += replyPids(resp, respLen, id);
+    }
+    return lines ? REPLY_NONE : REPLY_NO_DATA;
 }
 
 /**
@@ -322,21 +864,200 @@ int IsoCanAdapter::onTryConnectEcu(bool sendReply)
     open();
 
     if (!config_->getBoolProperty(PAR_BYPASS_INIT)) {
+        int sts = REPLY_NO_DATA;
+        saveBusState();
         if (driver_->send(&msgBuffer)) { 
-            if (receiveFromEcu(sendReply)) {
+            sts = receiveFromEcu(sendReply);
+            if (sts == REPLY_OK) {
                 connected_ = true;
                 sampleSent_= sendReply;
-                return extended_ ? PROT_ISO15765_2950 : PROT_ISO15765_1150;
+                return protocol_;
             }
         }
         close(); // Close only if not succeeded
-        sts_ = REPLY_NO_DATA;
+        sts_ = sts;
         return 0;
     }
     else {
         connected_ = true;
-        return extended_ ? PROT_ISO15765_2950 : PROT_ISO15765_1150;
+        return protocol_;
+    }
+}
+
+/**
+ * Get the bit rate for the current protocol, ATPB for the user one
+ * @return The bit rate, bit/s
+ */
+uint32_t IsoCanAdapter::getBitRate() const
+{
+    switch (protocol_) {
+        case PROT_ISO15765_1125:
+        case PROT_ISO15765_2925:
+            return CAN_BR_250K;
+        case PROT_ISO15765_USR_B: {
+            const ByteArray* pb = config_->getBytesProperty(PAR_USER_B);
+            if (pb->length == 2 && pb->data[1] != 0) { // 500k/N
+                uint32_t rate = CAN_BR_500K / pb->data[1];
+                return (pb->data[0] & UserBRate87) ? (rate * 8 / 7) : rate;
+            }
+            return CAN_BR_500K;
+        }
+        default:
+            return CAN_BR_500K;
+    }
+}
+
+/**
+ * Variable DLC is the user protocol option, ATPB not set keeps it on
+ * @return true if the frame is sent with the data length, false if padded to 8 bytes
+ */
+bool IsoCanAdapter::isVariableDlc() const
+{
+    if (protocol_ != PROT_ISO15765_USR_B)
+        return false;
+    const ByteArray* pb = config_->getBytesProperty(PAR_USER_B);
+    return pb->length != 2 || (pb->data[0] & UserBVarDlc);
+}
+
+/**
+ * The user protocol ID size, ATPB not set means 11 bit
+ * @return true if the user protocol is 29 bit CAN
+ */
+bool IsoCanAdapter::isUserBExtended()
+{
+    const ByteArray* pb = AdapterConfig::instance()->getBytesProperty(PAR_USER_B);
+    return pb->length == 2 && !(pb->data[0] & UserB11Bit);
+}
+
+void IsoCanAdapter::getDescription()
+{
+    char desc[40];
+    bool useAutoSP = config_->getBoolProperty(PAR_USE_AUTO_SP);
+    const char* name = (protocol_ == PROT_ISO15765_USR_B) ? "USER1" : "ISO 15765-4";
+    
+    sprintf(desc, "%s%s (CAN %d/%u)", (useAutoSP && protocol_ != PROT_ISO15765_USR_B) ? "AUTO, " : "",
+        name, extended_ ? 29 : 11, static_cast<unsigned>((getBitRate() + 500) / 1000));
+    AdptSendReply(desc);
+}
+
+void IsoCanAdapter::getDescriptionNum()
+{
+    char desc[4];
+    bool useAutoSP = config_->getBoolProperty(PAR_USE_AUTO_SP);
+    
+    sprintf(desc, "%s%X", (useAutoSP && protocol_ != PROT_ISO15765_USR_B) ? "A" : "", protocol_);
+    AdptSendReply(desc); 
+}
+
+/**
+ * Show all the frames the filter passes until the user break or the next
+ * command. ATCSM1 keeps the controller silent, no ACK or error frames are sent
+ * @return REPLY_NONE, REPLY_BUFFER_FULL if the frames were lost
+ */
+int IsoCanAdapter::monitor()
+{
+    bool silent = config_->getBoolProperty(PAR_CAN_MONITORING);
+    
+    open();
+    // Open filter if ATCF/ATCM are not set
+    if (!config_->getBytesProperty(PAR_CAN_FILTER)->length && !config_->getBytesProperty(PAR_CAN_MASK)->length) {
+        driver_->setFilterAndMask(0, 0, extended_);
+    }
+    if (silent) {
+        driver_->setSilent(true);
+    }
+    // STFAP pass filters, the OBD requests do not get these frames
+    CanFilterTable::instance()->enablePass(true);
+    
+    int sts = REPLY_NONE;
+    uint32_t overflows = driver_->getOverflowCount();
+    AdptWatchUserBreak(true);
+    while (!AdptUserBreak() && !AdptCmdPending()) {
+        if (driver_->getOverflowCount() != overflows) {
+            sts = REPLY_BUFFER_FULL; // UART is slower than the bus
+            break;
+        }
+        int count = 0;
+        const CanMsgBuffer* msgs = driver_->peek(count);
+        for (int i = 0; i < count; i++) {
+            formatter_->replyMonitor(&msgs[i]);
+        }
+        driver_->consume(count);
+        
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq();
+        if (!driver_->isReady() && !AdptUserBreak() && !AdptCmdPending()) {
+            __WFI(); // CAN or UART interrupt
+        }
+        __set_PRIMASK(primask);
+    }
+    AdptWatchUserBreak(false);
+    
+    CanFilterTable::instance()->enablePass(false);
+    if (silent) {
+        driver_->setSilent(false);
+    }
+    setFilterAndMask();
+    return sts;
+}
+
+/**
+ * Throughput self-test in silent loopback mode, the bus is untouched. The frames
+ * go through the receive ring, history and formatter to UART as with ATMA.
+ * The bit rate and the filter are left as the test set them
+ * @param[in] frameNum The number of frames to send
+ * @param[in] dlc The frame length, the data bytes are the frame counter pattern
+ * @param[out] stats The test results
+ */
+void IsoCanAdapter::loopbackTest(uint32_t frameNum, uint8_t dlc, LoopbackStats& stats)
+{
+    const int LOOPBACK_TIMEOUT = 100; // ms without any frame received
+    CanMsgBuffer msg(0x7E8, false, dlc, 0);
+    Timer* timer = Timer::instance(0);
+    
+    open();
+    driver_->setFilterAndMask(0, 0, false);
+    driver_->setLoopback(true);
+    
+    // Drop the frames received before
+    int count = 0;
+    do {
+        driver_->peek(count);
+        driver_->consume(count);
+    } while (count > 0);
+    
+    stats.sent = stats.received = 0;
+    uint32_t start = MicroTimer::now();
+    timer->start(LOOPBACK_TIMEOUT);
+    while (stats.received < stats.sent || stats.sent < frameNum) {
+        if (stats.sent < frameNum) {
+            IntAggregate seq(stats.sent);
+            for (int i = 0; i < 8; i++) {
+                msg.data[i] = seq.bvalue[i & 3];
+            }
+            if (driver_->send(&msg)) {
+                stats.sent++;
+            }
+        }
+        
+        const CanMsgBuffer* msgs = driver_->peek(count);
+        for (int i = 0; i < count; i++) {
+            history_->add2Buffer(&msgs[i], false, msgs[i].msgnum);
+            formatter_->replyMonitor(&msgs[i]);
+        }
+        driver_->consume(count);
+        stats.received += count;
+        
+        if (count > 0) {
+            timer->start(LOOPBACK_TIMEOUT);
+        }
+        else if (timer->isExpired()) {
+            break; // The rest are lost
+        }
     }
+    stats.elapsed = MicroTimer::elapsed(start);
+    
+    driver_->setLoopback(false); // The caller restores the bit rate and filter
 }
 
 /**
@@ -381,6 +1102,10 @@ void IsoCanAdapter::wiringCheck()
  */
 void IsoCan11Adapter::open()
 {
+    RxCtx.reset();
+    Timing.reset();
+    PidMapLoaded = 0;
+    driver_->setBitRate(getBitRate());
     setFilterAndMask();
     
     //Start using LED timer
@@ -433,64 +1158,9 @@ void IsoCan11Adapter::setFilterAndMask()
     driver_->setFilterAndMask(filter.lvalue, mask.lvalue, false);
 }
 
-void IsoCan11Adapter::processFlowFrame(const CanMsgBuffer* msg)
+uint8_t IsoCan11Adapter::processFlowFrame(const CanMsgBuffer* msg)
 {
-    if (!config_->getBoolProperty(PAR_CAN_FLOW_CONTROL))
-        return; // ATCFC0
-    
-    int flowMode = config_->getIntProperty(PAR_CAN_FLOW_CTRL_MD);
-    const ByteArray* hdr = config_->getBytesProperty(PAR_CAN_FLOW_CTRL_HDR);
-    const ByteArray* bytes = config_->getBytesProperty(PAR_CAN_FLOW_CTRL_DAT);
-    
-    CanMsgBuffer ctrlData(0x7E0, false, 8, 0x30, 0x00, 0x00);
-    ctrlData.id |= (msg->id & 0x07); //Figure out the return address
-    
-    if(flowMode == 1 && hdr != nullptr) {
-        ctrlData.id = hdr->asCanId() & 0x7FF;
-    }
-    if(flowMode > 0 && bytes != nullptr) {
-        memset(ctrlData.data, CanMsgBuffer::DefaultByte, sizeof(ctrlData.data));
-        memcpy(ctrlData.data, bytes->data, bytes->length);
-    }
-    driver_->send(&ctrlData);
-    
-    // Message log
-    history_->add2Buffer(&ctrlData, true, 0);
-}
-
-int IsoCan11Adapter::getProtocol() const
-{ 
-    return config_->getIntProperty(PAR_PROTOCOL);
-}
-
-void IsoCan11Adapter::getDescription()
-{
-    const char* desc = nullptr;
-    bool useAutoSP = config_->getBoolProperty(PAR_USE_AUTO_SP);
-    int protocol = getProtocol();
-    
-    if (protocol == PROT_ISO15765_USR_B) {
-        desc = "USER1 (CAN 11/500)";
-    }
-    else {
-        desc = useAutoSP ? "AUTO, ISO 15765-4 (CAN 11/500)" : "ISO 15765-4 (CAN 11/500)";
-    }
-    AdptSendReply(desc);
-}
-
-void IsoCan11Adapter::getDescriptionNum()
-{
-    const char* desc = nullptr;
-    bool useAutoSP = config_->getBoolProperty(PAR_USE_AUTO_SP);
-    int protocol = getProtocol();
-    
-    if (protocol == PROT_ISO15765_USR_B) {
-        desc = "B";
-    }
-    else {
-        desc = useAutoSP ? "A6" : "6";
-    }
-    AdptSendReply(desc); 
+    return sendFlowFrame(msg, 0x7E0 | (msg->id & 0x07)); //Figure out the return address
 }
 
 void IsoCan11Adapter::setReceiveAddress(const util::string& par)
@@ -502,6 +1172,10 @@ void IsoCan11Adapter::setReceiveAddress(const util::string& par)
  */
 void IsoCan29Adapter::open()
 {
+    RxCtx.reset();
+    Timing.reset();
+    PidMapLoaded = 0;
+    driver_->setBitRate(getBitRate());
     setFilterAndMask();
     
     // Start using LED timer
@@ -565,26 +1239,9 @@ void IsoCan29Adapter::setFilterAndMask()
     driver_->setFilterAndMask(filter.lvalue, mask.lvalue, true);
 }
 
-void IsoCan29Adapter::processFlowFrame(const CanMsgBuffer* msg)
-{
-    CanMsgBuffer ctrlData(0x18DA00F1, true, 8, 0x30, 0x0, 0x00);
-    ctrlData.id |= (msg->id & 0xFF) << 8;
-    driver_->send(&ctrlData);
-    
-    // Message log
-    history_->add2Buffer(&ctrlData, true, 0);
-}
-
-void IsoCan29Adapter::getDescription()
+uint8_t IsoCan29Adapter::processFlowFrame(const CanMsgBuffer* msg)
 {
-    bool useAutoSP = config_->getBoolProperty(PAR_USE_AUTO_SP);
-    AdptSendReply(useAutoSP ? "AUTO, ISO 15765-4 (CAN 29/500)" : "ISO 15765-4 (CAN 29/500)");
-}
-
-void IsoCan29Adapter::getDescriptionNum()
-{
-    bool useAutoSP = config_->getBoolProperty(PAR_USE_AUTO_SP);
-    AdptSendReply(useAutoSP ? "A7" : "7"); 
+    return sendFlowFrame(msg, 0x18DA00F1 | ((msg->id & 0xFF) << 8)); //Figure out the return address
 }
 
 void IsoCan29Adapter::setReceiveAddress(const util::string& par)
@@ -6,9 +6,11 @@
 #define __ISO_CAN_H__
 
 #include "padapter.h"
+#include "isotp.h"
 
 
 class CanDriver;
+class Timer;
 class CanHistory;
 struct CanMsgBuffer;
 class CanReplyFormatter;
@@ -19,55 +21,82 @@ public:
     static const int CANFirstFrame       = 1;
     static const int CANConsecutiveFrame = 2;
     static const int CANFlowControlFrame = 3;
+    // ATPB options byte
+    static const uint8_t UserB11Bit      = 0x80;
+    static const uint8_t UserBVarDlc     = 0x40;
+    static const uint8_t UserBRate87     = 0x10;
 public:
-    virtual int onRequest(const uint8_t* data, int len);
+    virtual int onRequest(const uint8_t* data, int len, int numOfResp);
     virtual int onTryConnectEcu(bool sendReply);
     virtual void setCanCAF(bool val) {}
     virtual void wiringCheck();
     virtual void dumpBuffer();
+    virtual int monitor();
+    virtual int sendRtr();
+    virtual int batchPids(const uint8_t* pids, int num);
+    virtual void loopbackTest(uint32_t frameNum, uint8_t dlc, LoopbackStats& stats);
+    virtual void getDescription();
+    virtual void getDescriptionNum();
+    virtual void setProtocol(int protocol) { protocol_ = protocol; }
+    virtual int getProtocol() const { return protocol_; }
+    static bool isUserBExtended();
 protected:
     IsoCanAdapter();
+    uint32_t getBitRate() const;
+    bool isVariableDlc() const;
     virtual uint32_t getID() const = 0;
-    virtual void processFlowFrame(const CanMsgBuffer* msgBuffer) = 0;
+    virtual uint8_t processFlowFrame(const CanMsgBuffer* msgBuffer) = 0;
     bool sendToEcu(const uint8_t* data, int len);
     bool sendFrameToEcu(const uint8_t* data, uint8_t len, uint8_t dlc);
     bool sendToEcuMF(const uint8_t* data, int len);
-    bool receiveFromEcu(bool sendReply);
+    int receiveFromEcu(bool sendReply, int numOfResp = 0);
     bool checkResponsePending(const CanMsgBuffer* msg);
-    bool receiveControlFrame(uint8_t& fs, uint8_t& bs, uint8_t& stmin);
     int getP2MaxTimeout() const;
+    void saveBusState();
+    int checkBusErrors();
+    bool isTxStuck(uint8_t tec);
+    void waitForFrame(const Timer* timer);
+    bool isPhysicalRequest() const;
+    uint8_t sendFlowFrame(const CanMsgBuffer* msg, uint32_t id);
+    void replyFrame(const CanMsgBuffer* msg, IsoTpContext* ctx);
+    void holdFrame(const CanMsgBuffer* msg, IsoTpContext* ctx);
+    void releaseFrames(bool all);
+    int requestData(const uint8_t* data, int len, uint8_t* resp, int& respLen, uint32_t& respId);
+    bool isPidSupported(uint8_t pid);
+    int replyPids(uint8_t* resp, int len, uint32_t id);
 protected:
     CanDriver*  driver_;
     CanHistory* history_;
     CanReplyFormatter* formatter_;
     bool        extended_;
     bool        canExtAddr_;
+    bool        txPendWatch_;
+    bool        txStopped_;   // The multi-frame send stopped by the user
+    uint8_t     txErrors_;    // TEC at the request start
+    int         protocol_;
+    uint32_t    rxOverflows_; // Frames lost before the request start
+    uint32_t    txPendStart_; // MicroTimer time the pending frame was first seen
+    IsoTpContext* owner_;     // The responder printed now, the others are held
 };
 
 class IsoCan11Adapter : public IsoCanAdapter {
 public:
-    IsoCan11Adapter() {}
+    IsoCan11Adapter() { protocol_ = PROT_ISO15765_1150; }
     virtual int onConnectEcu();
-    virtual void getDescription();
-    virtual void getDescriptionNum();
     virtual uint32_t getID() const;
     virtual void setFilterAndMask();
-    virtual void processFlowFrame(const CanMsgBuffer* msgBuffer);
-    virtual int getProtocol() const; // It could be also a custom one
+    virtual uint8_t processFlowFrame(const CanMsgBuffer* msgBuffer);
     virtual void open();
     static void setReceiveAddress(const util::string& par);
 };
 
 class IsoCan29Adapter : public IsoCanAdapter {
 public:
-    IsoCan29Adapter() { extended_ = true; }
+    IsoCan29Adapter() { extended_ = true; protocol_ = PROT_ISO15765_2950; }
     virtual int onConnectEcu();
-    virtual void getDescription();
-    virtual void getDescriptionNum();
     virtual uint32_t getID() const;
     virtual void setFilterAndMask();
-    virtual void processFlowFrame(const CanMsgBuffer* msgBuffer);
-    virtual int getProtocol() const { return PROT_ISO15765_2950; }
+    virtual uint8_t processFlowFrame(const CanMsgBuffer* msgBuffer);
     virtual void open();
     static void setReceiveAddress(const util::string& par);
 };
@@ -78,8 +107,12 @@ public:
     void reply(const CanMsgBuffer* msg);
     void replyFirstFrame(const CanMsgBuffer* msg);
     void replyNextFrame(const CanMsgBuffer* msg, int num);
+    void replyMonitor(const CanMsgBuffer* msg);
+    void replyData(uint32_t id, bool extended, const uint8_t* data, uint32_t dlen);
 private:
     uint32_t getConfigKey();
+    void addTimestamp(const CanMsgBuffer* msg, util::string& str);
+    bool replyRtr(const CanMsgBuffer* msg, util::string& str);
     AdapterConfig* config_;
     void replyH1(const CanMsgBuffer* msg, uint32_t dlen, util::string& str);
     void replyH0(const CanMsgBuffer* msg, uint32_t offst, uint32_t dlen, util::string& str);
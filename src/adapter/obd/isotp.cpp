@@ -0,0 +1,430 @@
+/**
+ * See the file LICENSE for redistribution information.
+ *
+ * Copyright (c) 2009-2016 ObdDiag.Net. All rights reserved.
+ *
+ */
+
+#include <cstring>
+#include <cortexm.h>
+#include <CanDriver.h>
+#include <Timer.h>
+#include "canmsgbuffer.h"
+#include "isocan.h"
+#include "isotp.h"
+
+using namespace std;
+
+const int CAN_FRAME_LEN = 8;
+const uint32_t N_BS_TIMEOUT = 1000000; // usec, flow control frame wait
+const uint32_t N_CS_TIMEOUT = 1000000; // usec, the next consecutive frame has to go out within
+const int N_WFT_MAX         = 10;      // FC.WAIT frames accepted in a row
+const int FC_CTS            = 0;       // Flow status, continue to send
+const int FC_WAIT           = 1;       // Flow status, wait for the next FC
+const uint32_t STMIN_MAX_USEC = 127000; // The reserved STmin values are taken as 127 ms
+
+/**
+ * Decode ISO 15765-2 STmin value
+ * @param[in] stmin The flow control STmin byte
+ * @return The separation time, usec
+ */
+static uint32_t StminToUsec(uint8_t stmin)
+{
+    if (stmin <= 0x7F)
+        return stmin * 1000;        // 0-127 ms
+    if (stmin >= 0xF1 && stmin <= 0xF9)
+        return (stmin - 0xF0) * 100; // 100-900 usec
+    return STMIN_MAX_USEC;
+}
+
+/**
+ * Drop the message in progress
+ */
+void IsoTpReceiver::reset()
+{
+    length_ = 0;
+    received_ = 0;
+    sn_ = 0;
+    receiving_ = false;
+}
+
+/**
+ * Track the received frame
+ * @param[in] msg CanMsgbuffer instance pointer
+ * @param[in] extAddr CAN extended address flag, the first byte is the address
+ * @return The frame event, IsoTpEvents
+ */
+int IsoTpReceiver::onFrame(const CanMsgBuffer* msg, bool extAddr)
+{
+    const int offst = extAddr ? 1 : 0;
+    const uint8_t* pci = msg->data + offst;
+    int dlc = (msg->dlc > CAN_FRAME_LEN) ? CAN_FRAME_LEN : msg->dlc;
+    int dataLen = dlc - offst - 1; // Bytes after PCI byte
+
+    if (dataLen < 0)
+        return ISOTP_UNEXPECTED;
+
+    switch (pci[0] >> 4) {
+        case IsoCanAdapter::CANSingleFrame:
+            reset(); // The single frame ends the message in progress
+            if ((pci[0] & 0x0F) == 0 || (pci[0] & 0x0F) > dataLen)
+                return ISOTP_UNEXPECTED;
+            return ISOTP_COMPLETE;
+
+        case IsoCanAdapter::CANFirstFrame:
+            length_ = ((pci[0] & 0x0F) << 8) | pci[1];
+            received_ = dataLen - 1; // 1.5 bytes length
+            sn_ = 1;
+            receiving_ = (received_ < length_);
+            return receiving_ ? ISOTP_FIRST : ISOTP_UNEXPECTED;
+
+        case IsoCanAdapter::CANConsecutiveFrame:
+            if (!receiving_)
+                return ISOTP_UNEXPECTED;
+            if ((pci[0] & 0x0F) != sn_) {
+                reset();
+                return ISOTP_SEQ_ERROR;
+            }
+            sn_ = (sn_ + 1) & 0x0F;
+            received_ += dataLen;
+            if (received_ >= length_) {
+                receiving_ = false;
+                return ISOTP_COMPLETE;
+            }
+            return ISOTP_NEXT;
+
+        case IsoCanAdapter::CANFlowControlFrame:
+            return ISOTP_NONE;
+
+        default:
+            return ISOTP_UNEXPECTED;
+    }
+}
+
+/**
+ * Drop all the contexts
+ */
+void IsoTpContextTable::reset()
+{
+    for (IsoTpContext& ctx : ctx_) {
+        ctx.used = false;
+    }
+}
+
+/**
+ * Get the responder context, the new one is allocated for the unknown ID
+ * @param[in] id The responder CAN ID
+ * @return The context pointer, nullptr if all the contexts are receiving
+ */
+IsoTpContext* IsoTpContextTable::get(uint32_t id)
+{
+    IsoTpContext* freeCtx = nullptr;
+    
+    for (IsoTpContext& ctx : ctx_) {
+        if (ctx.used && ctx.id == id)
+            return &ctx;
+        if (!freeCtx && (!ctx.used || !ctx.rx.isReceiving()))
+            freeCtx = &ctx; // Unused or idle, could be taken over
+    }
+    if (freeCtx) {
+        freeCtx->id = id;
+        freeCtx->rx.reset();
+        freeCtx->lineNum = 0;
+        freeCtx->blockSize = 0;
+        freeCtx->blockCnt = 0;
+        freeCtx->used = true;
+    }
+    return freeCtx;
+}
+
+/**
+ * Check for the unfinished messages
+ * @return true if any context is in the middle of the message
+ */
+bool IsoTpContextTable::isReceiving() const
+{
+    for (const IsoTpContext& ctx : ctx_) {
+        if (ctx.used && ctx.rx.isReceiving())
+            return true;
+    }
+    return false;
+}
+
+/**
+ * FlowControlTable singleton
+ * @return The pointer to FlowControlTable instance
+ */
+FlowControlTable* FlowControlTable::instance()
+{
+    static FlowControlTable instance;
+    return &instance;
+}
+
+/**
+ * Add the flow control address pair, the existing pair with the same
+ * receive ID is replaced
+ * @param[in] txId The flow control frame ID
+ * @param[in] rxId The ECU response ID
+ * @param[in] extended CAN 29 bit flag
+ * @return true if OK, false if the table is full
+ */
+bool FlowControlTable::add(uint32_t txId, uint32_t rxId, bool extended)
+{
+    int i = 0;
+    for (; i < pairNum_; i++) {
+        if (pairs_[i].rxId == rxId && pairs_[i].extended == extended)
+            break;
+    }
+    if (i == MAX_PAIRS)
+        return false;
+
+    pairs_[i].txId = txId;
+    pairs_[i].rxId = rxId;
+    pairs_[i].extended = extended;
+    if (i == pairNum_)
+        pairNum_++;
+    return true;
+}
+
+/**
+ * Look up the flow control ID for the ECU response ID
+ * @param[in] rxId The ECU response ID
+ * @param[in] extended CAN 29 bit flag
+ * @param[out] txId The flow control frame ID, unchanged if not found
+ * @return true if found, false otherwise
+ */
+bool FlowControlTable::find(uint32_t rxId, bool extended, uint32_t& txId) const
+{
+    for (int i = 0; i < pairNum_; i++) {
+        if (pairs_[i].rxId == rxId && pairs_[i].extended == extended) {
+            txId = pairs_[i].txId;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * IsoTpSender singleton, the transmit complete callback is a plain function
+ * @return The pointer to IsoTpSender instance
+ */
+IsoTpSender* IsoTpSender::instance()
+{
+    static IsoTpSender instance;
+    return &instance;
+}
+
+IsoTpSender::IsoTpSender() : data_(nullptr), length_(0), frameNum_(0), queued_(0), completed_(0),
+    state_(ISOTP_TX_IDLE), stmin_(0)
+{
+}
+
+/**
+ * Send the first frame and wait for the flow control
+ * @param[in] id CAN ID
+ * @param[in] extended CAN 29 bit flag
+ * @param[in] extAddr CAN extended address flag
+ * @param[in] addrByte CAN extended address byte
+ * @param[in] data The message data bytes, kept till the end of the transfer
+ * @param[in] length The message length
+ * @return true if the first frame queued, false otherwise
+ */
+bool IsoTpSender::start(uint32_t id, bool extended, bool extAddr, uint8_t addrByte, const uint8_t* data, int length)
+{
+    const int ffDataLen = extAddr ? 5 : 6;
+    const int cfDataLen = extAddr ? 6 : 7;
+    
+    id_        = id;
+    extended_  = extended;
+    extAddr_   = extAddr;
+    addrByte_  = addrByte;
+    data_      = data;
+    length_    = length;
+    frameNum_  = 1 + (length - ffDataLen + cfDataLen - 1) / cfDataLen;
+    queued_    = 0;
+    completed_ = 0;
+    blockSize_ = 0;
+    blockCnt_  = 0;
+    waitCnt_   = 0;
+    stmin_     = 0;
+    lastTime_  = MicroTimer::now();
+    state_     = ISOTP_TX_WAIT_FC;
+    
+    CanDriver::instance()->setTxCallback(OnTxComplete);
+    queueNext();
+    return state_ != ISOTP_TX_ERROR;
+}
+
+/**
+ * Build the message frame
+ * @param[in] num The frame number, 0 is the first frame
+ * @param[out] msg The frame
+ */
+void IsoTpSender::getFrame(int num, CanMsgBuffer* msg) const
+{
+    const int ffDataLen = extAddr_ ? 5 : 6;
+    const int cfDataLen = extAddr_ ? 6 : 7;
+    int idx = 0;
+    
+    *msg = CanMsgBuffer(id_, extended_, CAN_FRAME_LEN, 0);
+    if (extAddr_)
+        msg->data[idx++] = addrByte_;
+    
+    if (num == 0) {
+        msg->data[idx++] = 0x10 | ((length_ & 0xF00) >> 8); // Maximum 4095 bytes, 1.5 byte len
+        msg->data[idx++] = length_ & 0xFF;
+        memcpy(msg->data + idx, data_, ffDataLen);
+        return;
+    }
+    
+    int pos = ffDataLen + (num - 1) * cfDataLen;
+    int numToSend = (length_ - pos > cfDataLen) ? cfDataLen : (length_ - pos);
+    msg->data[idx++] = 0x20 | (num & 0x0F);
+    memcpy(msg->data + idx, data_ + pos, numToSend);
+    msg->dlc = idx + numToSend;
+}
+
+/**
+ * Queue the next frame, called with the interrupts disabled or from ISR
+ */
+void IsoTpSender::queueNext()
+{
+    CanMsgBuffer msg;
+    
+    getFrame(queued_, &msg);
+    if (!CanDriver::instance()->send(&msg)) {
+        state_ = ISOTP_TX_ERROR;
+        return;
+    }
+    if (queued_ > 0)
+        blockCnt_++;
+    queued_++;
+}
+
+/**
+ * The transmit complete callback, called from CAN ISR
+ * @param[in] msg The transmitted frame
+ * @param[in] ok true if transmitted, false if failed or aborted
+ */
+void IsoTpSender::OnTxComplete(const CanMsgBuffer* msg, bool ok)
+{
+    instance()->onTxComplete(ok);
+}
+
+void IsoTpSender::onTxComplete(bool ok)
+{
+    if (!isBusy())
+        return;
+    if (!ok) {
+        state_ = ISOTP_TX_ERROR;
+        return;
+    }
+    completed_++;
+    lastTime_ = MicroTimer::now();
+    if (state_ != ISOTP_TX_SENDING || completed_ != queued_)
+        return;
+    
+    if (queued_ == frameNum_) {
+        state_ = ISOTP_TX_DONE;
+    }
+    else if (isBlockOver()) {
+        state_ = ISOTP_TX_WAIT_FC; // The receiver sends the next FC
+    }
+    else if (stmin_ == 0) {
+        queueNext();
+    }
+}
+
+/**
+ * Process the flow control frame from the receiver
+ * @param[in] fs The flow status
+ * @param[in] bs The block size
+ * @param[in] stmin The separation time
+ */
+void IsoTpSender::onFlowControl(uint8_t fs, uint8_t bs, uint8_t stmin)
+{
+    if (state_ != ISOTP_TX_WAIT_FC)
+        return;
+    
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    
+    lastTime_ = MicroTimer::now();
+    if (fs == FC_CTS) {
+        blockSize_ = bs;
+        blockCnt_ = 0;
+        waitCnt_ = 0;
+        stmin_ = StminToUsec(stmin);
+        state_ = ISOTP_TX_SENDING;
+        if (completed_ == queued_ && stmin_ == 0) {
+            queueNext(); // The rest goes from the transmit interrupt
+        }
+    }
+    else if (fs != FC_WAIT || ++waitCnt_ > N_WFT_MAX) {
+        state_ = ISOTP_TX_ERROR; // FC.OVFLW, reserved or N_WFTmax exceeded
+    }
+    
+    __set_PRIMASK(primask);
+}
+
+/**
+ * Queue the next frame once STmin passed since the previous one went out
+ */
+void IsoTpSender::poll()
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    
+    if (state_ == ISOTP_TX_SENDING && completed_ == queued_ && !isBlockOver()) {
+        // STmin counts from the end of the previous frame
+        if (MicroTimer::elapsed(lastTime_) >= stmin_) {
+            queueNext();
+        }
+    }
+    
+    __set_PRIMASK(primask);
+}
+
+/**
+ * Time left until the next paced frame could be queued. STmin counts from
+ * the end of the previous frame, the frame not transmitted yet gets full STmin
+ * @return usec, 0 if the frame could be queued now
+ */
+uint32_t IsoTpSender::getPaceTime() const
+{
+    if (completed_ != queued_)
+        return stmin_;
+    uint32_t elapsed = MicroTimer::elapsed(lastTime_);
+    return (elapsed >= stmin_) ? 0 : (stmin_ - elapsed);
+}
+
+/**
+ * Check N_Bs/N_Cs timeouts
+ * @return true if the receiver or the bus stalled the transfer
+ */
+bool IsoTpSender::isTimedOut() const
+{
+    uint32_t elapsed = MicroTimer::elapsed(lastTime_);
+    if (state_ == ISOTP_TX_WAIT_FC)
+        return elapsed > N_BS_TIMEOUT;
+    if (state_ == ISOTP_TX_SENDING)
+        return elapsed > (N_CS_TIMEOUT + stmin_);
+    return false;
+}
+
+/**
+ * Stop the transfer and drop the queued frames
+ */
+void IsoTpSender::abort()
+{
+    state_ = ISOTP_TX_ERROR;
+    CanDriver::instance()->abortTx();
+}
+
+/**
+ * Release the transmit complete callback
+ */
+void IsoTpSender::close()
+{
+    CanDriver::instance()->setTxCallback(nullptr);
+}
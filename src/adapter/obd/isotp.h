@@ -0,0 +1,149 @@
+/**
+ * See the file LICENSE for redistribution information.
+ *
+ * Copyright (c) 2009-2016 ObdDiag.Net. All rights reserved.
+ *
+ */
+
+#ifndef __ISO_TP_H__
+#define __ISO_TP_H__
+
+#include <cstdint>
+
+using namespace std;
+
+struct CanMsgBuffer;
+
+// Receive frame events
+enum IsoTpEvents {
+    ISOTP_NONE = 0,   // Not a data frame (flow control)
+    ISOTP_FIRST,      // First frame, the message started
+    ISOTP_NEXT,       // Consecutive frame in sequence
+    ISOTP_COMPLETE,   // Single frame or the last consecutive frame
+    ISOTP_SEQ_ERROR,  // Wrong SN, the frame is missing, the message dropped
+    ISOTP_UNEXPECTED  // Consecutive frame without first frame, wrong PCI
+};
+
+//
+// ISO 15765-2 receive reassembly. Only the message length, SN and
+// the byte count are tracked, the data is printed frame by frame
+// by CanReplyFormatter, no payload buffer is kept
+//
+class IsoTpReceiver {
+public:
+    IsoTpReceiver() { reset(); }
+    void reset();
+    int onFrame(const CanMsgBuffer* msg, bool extAddr);
+    bool isReceiving() const { return receiving_; }
+    uint32_t getLength() const { return length_; }
+    uint32_t getReceived() const { return received_; }
+private:
+    uint16_t length_;   // Announced by the first frame
+    uint16_t received_; // Data bytes received
+    uint8_t  sn_;       // The next expected SN
+    bool     receiving_;
+};
+
+const int ISOTP_CONTEXT_NUM = 4;
+
+// Reassembly context of one responder
+struct IsoTpContext {
+    uint32_t      id;        // The responder CAN ID
+    IsoTpReceiver rx;
+    uint8_t       lineNum;   // Consecutive frames printed, "N:" line index
+    uint8_t       blockSize; // BS granted by the last flow control frame
+    uint8_t       blockCnt;  // Consecutive frames received since
+    bool          used;
+};
+
+//
+// Per-responder contexts, a functional request could get interleaved
+// multi-frame responses from several ECUs
+//
+class IsoTpContextTable {
+public:
+    IsoTpContextTable() { reset(); }
+    void reset();
+    IsoTpContext* get(uint32_t id);
+    bool isReceiving() const;
+private:
+    IsoTpContext ctx_[ISOTP_CONTEXT_NUM];
+};
+
+// Transmit states
+enum IsoTpSendStates {
+    ISOTP_TX_IDLE = 0,
+    ISOTP_TX_WAIT_FC, // Waiting for the flow control frame
+    ISOTP_TX_SENDING, // The consecutive frames are going out
+    ISOTP_TX_DONE,    // The last frame is sent
+    ISOTP_TX_ERROR    // Overflow, timeout or transmit error, aborted
+};
+
+//
+// ISO 15765-2 multi-frame transmitter. The consecutive frames are queued
+// by the CAN transmit complete interrupt, the main loop feeds the flow
+// control frames and paces the frames with STmin > 0, sleeping
+// between them if STmin is a millisecond or more
+//
+class IsoTpSender {
+public:
+    static IsoTpSender* instance();
+    bool start(uint32_t id, bool extended, bool extAddr, uint8_t addrByte, const uint8_t* data, int length);
+    void onFlowControl(uint8_t fs, uint8_t bs, uint8_t stmin);
+    void poll();
+    void abort();
+    void close();
+    bool isBusy() const { return state_ == ISOTP_TX_WAIT_FC || state_ == ISOTP_TX_SENDING; }
+    bool isPacing() const { return state_ == ISOTP_TX_SENDING && stmin_ > 0; }
+    bool isTimedOut() const;
+    uint32_t getPaceTime() const;
+    int getState() const { return state_; }
+    int getQueued() const { return queued_; }
+    void getFrame(int num, CanMsgBuffer* msg) const;
+private:
+    IsoTpSender();
+    static void OnTxComplete(const CanMsgBuffer* msg, bool ok);
+    void onTxComplete(bool ok);
+    bool isBlockOver() const { return blockSize_ && blockCnt_ == blockSize_; }
+    void queueNext();
+    const uint8_t*    data_;
+    uint32_t          id_;
+    uint16_t          length_;
+    bool              extended_;
+    bool              extAddr_;
+    uint8_t           addrByte_;
+    uint8_t           blockSize_;
+    volatile uint8_t  blockCnt_;  // Consecutive frames queued in the block
+    uint8_t           waitCnt_;   // FC.WAIT frames in a row
+    int               frameNum_;  // The message frame number
+    volatile int      queued_;    // Frames queued
+    volatile int      completed_; // Frames transmitted
+    volatile int      state_;
+    uint32_t          stmin_;     // usec
+    volatile uint32_t lastTime_;  // The last state change or transmit, usec
+};
+
+struct FlowControlPair {
+    uint32_t txId; // The flow control frame ID to send
+    uint32_t rxId; // The first frame ID it answers
+    bool     extended;
+};
+
+//
+// Flow control address pairs, "STCFCPA", the pair ID takes over
+// the automatic physical address of the flow control frame
+//
+class FlowControlTable {
+public:
+    const static int MAX_PAIRS = 4;
+    static FlowControlTable* instance();
+    bool add(uint32_t txId, uint32_t rxId, bool extended);
+    void clear() { pairNum_ = 0; }
+    bool find(uint32_t rxId, bool extended, uint32_t& txId) const;
+private:
+    FlowControlTable() : pairNum_(0) {}
+    FlowControlPair pairs_[MAX_PAIRS];
+    int             pairNum_;
+};
+
+#endif //__ISO_TP_H__
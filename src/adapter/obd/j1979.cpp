@@ -0,0 +1,46 @@
+/**
+ * See the file LICENSE for redistribution information.
+ *
+ * Copyright (c) 2009-2016 ObdDiag.Net. All rights reserved.
+ *
+ */
+
+#include "j1979.h"
+
+// Mode 01 PID 00-5F data bytes, 0 if the length varies
+static const uint8_t PidLengths[] = {
+//  0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
+    4, 4, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 2, 1, 1, 1, // 00
+    2, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 2, // 10
+    4, 2, 2, 2, 4, 4, 4, 4, 4, 4, 4, 4, 1, 1, 1, 1, // 20
+    1, 2, 2, 1, 4, 4, 4, 4, 4, 4, 4, 4, 2, 2, 2, 2, // 30
+    4, 4, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 4, // 40
+    4, 1, 1, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 2, 2, 1  // 50
+};
+
+// The well known PIDs above 5F, PID and the data bytes
+static const uint8_t PidLengthsExt[][2] = {
+    { 0x60, 4 }, { 0x61, 1 }, { 0x62, 1 }, { 0x63, 2 }, { 0x64, 5 },
+    { 0x65, 2 }, { 0x66, 5 }, { 0x67, 3 }, { 0x69, 7 }, { 0x6A, 5 },
+    { 0x6B, 5 }, { 0x6C, 5 }, { 0x6F, 3 }, { 0x7D, 1 }, { 0x7E, 1 },
+    { 0x80, 4 }, { 0x84, 1 }, { 0x8D, 1 }, { 0x8E, 1 }, { 0xA0, 4 },
+    { 0xA2, 2 }, { 0xA6, 4 }, { 0xC0, 4 }
+};
+
+/**
+ * The number of data bytes in the Mode 01 response of the PID
+ * @param[in] pid The PID
+ * @return The data length, 0 if unknown
+ */
+int GetPidDataLength(uint8_t pid)
+{
+    if (pid < sizeof(PidLengths)) {
+        return PidLengths[pid];
+    }
+    for (const auto& entry : PidLengthsExt) {
+        if (entry[0] == pid) {
+            return entry[1];
+        }
+    }
+    return 0;
+}
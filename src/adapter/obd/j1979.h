@@ -29,4 +29,8 @@ enum IsoTimeouts {
 
 const uint8_t TESTER_ADDRESS = 0xF1;
 
+const int MAX_PIDS_PER_REQUEST = 6; // Mode 01 PIDs in one CAN request
+
+int GetPidDataLength(uint8_t pid);
+
 #endif //__J1979_DEFINES_H__
@@ -7,6 +7,8 @@
 
 #include <cstdio>
 #include "obdprofile.h"
+#include "isocan.h"
+#include <candriver.h>
 #include <datacollector.h>
 
 using namespace util;
@@ -23,6 +25,9 @@ static const char Err5Message[] = "FB ERROR";          // Wiring
 static const char Err6Message[] = "BUS BUSY";          // Bus collision or busy
 static const char Err7Message[] = "BUS ERROR";         // Bus error
 static const char Err8Message[] = "DATA ERROR>";       // Checksum
+static const char Err9Message[] = "CAN ERROR";         // CAN transmission failed
+static const char ErrAMessage[] = "BUFFER FULL";       // Receive overflow
+static const char ErrBMessage[] = "STOPPED";           // Interrupted by the user
 static const char Err0Message[] = "Program Error";     // Wrong coding?
 
 
@@ -71,23 +76,31 @@ void OBDProfile::dumpBuffer()
 int OBDProfile::setProtocol(int num, bool refreshConnection)
 {
     ProtocolAdapter* pvadapter = adapter_;
+    int pvprotocol = adapter_->getProtocol();
     switch (num) {
         case PROT_AUTO:
             adapter_ = ProtocolAdapter::getAdapter(ADPTR_AUTO);
             break;
         case PROT_ISO15765_1150:
-        case PROT_ISO15765_USR_B:
+        case PROT_ISO15765_1125:
             adapter_ = ProtocolAdapter::getAdapter(ADPTR_CAN);
+            adapter_->setProtocol(num);
             break;
         case PROT_ISO15765_2950:
+        case PROT_ISO15765_2925:
             adapter_ = ProtocolAdapter::getAdapter(ADPTR_CAN_EXT);
+            adapter_->setProtocol(num);
+            break;
+        case PROT_ISO15765_USR_B:
+            adapter_ = ProtocolAdapter::getAdapter(IsoCanAdapter::isUserBExtended() ? ADPTR_CAN_EXT : ADPTR_CAN);
+            adapter_->setProtocol(num);
             break;
         default:
             return REPLY_CMD_WRONG;
     }
     // Do this if only "ATSP" executed
     if (refreshConnection) {
-        if (pvadapter != adapter_) { 
+        if (pvadapter != adapter_ || pvprotocol != num) { // Same adapter could be the other bit rate
             pvadapter->close();
             adapter_->open();
         }
@@ -101,10 +114,29 @@ int OBDProfile::setProtocol(int num, bool refreshConnection)
  * @return The status code
  */
 void OBDProfile::onRequest(const DataCollector* collector)
+{
+    replyStatus(onRequestImpl(collector->getData(), collector->getLength(), collector->getResponseNum()));
+}
+
+/**
+ * The entry for ECU send/receive function, the binary request
+ * @param[in] data The request bytes
+ * @param[in] len The request length
+ * @param[in] numOfResp The number of responses to wait for, 0 if unknown
+ */
+void OBDProfile::onRequest(const uint8_t* data, int len, int numOfResp)
+{
+    replyStatus(onRequestImpl(data, len, numOfResp));
+}
+
+/**
+ * Send the error message for the completion status
+ * @param[in] result The completion status code
+ */
+void OBDProfile::replyStatus(int result)
 {
     char prefix[12];
     
-    int result = onRequestImpl(collector);
     switch(result) {
         case REPLY_CMD_WRONG:
             AdptSendReply(ErrMessage);
@@ -133,6 +165,15 @@ void OBDProfile::onRequest(const DataCollector* collector)
         case REPLY_WIRING_ERROR:
             AdptSendReply(Err5Message);
             break;        
+        case REPLY_CAN_ERROR:
+            AdptSendReply(Err9Message);
+            break;
+        case REPLY_BUFFER_FULL:
+            AdptSendReply(ErrAMessage);
+            break;
+        case REPLY_STOPPED:
+            AdptSendReply(ErrBMessage);
+            break;
         case REPLY_NONE:
         case 0:
             break;
@@ -148,26 +189,27 @@ void OBDProfile::onRequest(const DataCollector* collector)
 
 /**
  * The actual implementation of request handler
- * @param[in] collector The command
+ * @param[in] data The request bytes
+ * @param[in] len The request length
+ * @param[in] numOfResp The number of responses to wait for, 0 if unknown
  * @return The status code
  */
-int OBDProfile::onRequestImpl(const DataCollector* collector)
+int OBDProfile::onRequestImpl(const uint8_t* data, int len, int numOfResp)
 {
-    const char* OBD_TEST_SEQ = "0100";
-
     // Valid request length?
-    if (!sendLengthCheck(collector->getLength())) {
+    if (!sendLengthCheck(len)) {
         return REPLY_DATA_ERROR;
     }
 
     // The regular flow stops here
     if (adapter_->isConnected()) {
-        return adapter_->onRequest(collector->getData(), collector->getLength()); //1
+        return adapter_->onRequest(data, len, numOfResp); //1
     } 
 
     // Convoluted logic
     //
-    bool sendReply = (collector->getString() == OBD_TEST_SEQ);
+    bool sendReply = (len == 2 && data[0] == 0x01 && data[1] == 0x00); // "0100"
+
     int protocol = 0;
     int sts = REPLY_NO_DATA;
     
@@ -201,7 +243,7 @@ int OBDProfile::onRequestImpl(const DataCollector* collector)
     if (protocol) {
         setProtocol(protocol, false);
         if (!autoAdapter->isSampleSent()) {
-            sts = adapter_->onRequest(collector->getData(), collector->getLength()); //5
+            sts = adapter_->onRequest(data, len, numOfResp); //5
         }
         else {
             sts = REPLY_NONE; //the command sent already as part of autoconnect
@@ -255,6 +297,50 @@ void OBDProfile::sendHeartBeat()
     adapter_->sendHeartBeat();
 }
 
+/**
+ * Monitor the bus with the current protocol
+ */
+void OBDProfile::monitor()
+{
+    replyStatus(adapter_->monitor());
+}
+
+/**
+ * Loopback throughput self-test, always with CAN adapter
+ * @param[in] frameNum The number of frames to send
+ * @param[in] dlc The frame length
+ * @param[out] stats The test results
+ */
+void OBDProfile::loopbackTest(uint32_t frameNum, uint8_t dlc, LoopbackStats& stats)
+{
+    CanDriver* driver = CanDriver::instance();
+    uint32_t bitRate = driver->getBitRate();
+    
+    ProtocolAdapter::getAdapter(ADPTR_CAN)->loopbackTest(frameNum, dlc, stats);
+    
+    // The test runs with 11 bit adapter, the active protocol could be the other
+    driver->setBitRate(bitRate);
+    adapter_->setFilterAndMask();
+}
+
+/**
+ * Send CAN remote frame with the current protocol
+ */
+void OBDProfile::sendRtr()
+{
+    replyStatus(adapter_->sendRtr());
+}
+
+/**
+ * Mode 01 request of the PID list, batched by the current protocol adapter
+ * @param[in] pids The PIDs
+ * @param[in] num The number of PIDs
+ */
+void OBDProfile::batchPids(const uint8_t* pids, int num)
+{
+    replyStatus(adapter_->batchPids(pids, num));
+}
+
 /**
  * Test wiring connectivity for all protocols
  */
@@ -25,13 +25,19 @@ public:
     void dumpBuffer();
     void closeProtocol();
     void onRequest(const DataCollector* collector);
+    void onRequest(const uint8_t* data, int len, int numOfResp);
     int getProtocol() const;
     void wiringCheck();
+    void monitor();
+    void sendRtr();
+    void batchPids(const uint8_t* pids, int num);
+    void loopbackTest(uint32_t frameNum, uint8_t dlc, LoopbackStats& stats);
     int kwDisplay();
     void setFilterAndMask();
 private:
     bool sendLengthCheck(int len);
-    int onRequestImpl(const DataCollector* collector);
+    int onRequestImpl(const uint8_t* data, int len, int numOfResp);
+    void replyStatus(int result);
     ProtocolAdapter* adapter_;
 };
 
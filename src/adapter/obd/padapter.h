@@ -23,7 +23,10 @@ enum ReplyTypes {
     REPLY_BUS_BUSY,
     REPLY_BUS_ERROR,
     REPLY_CHKS_ERROR,
-    REPLY_WIRING_ERROR
+    REPLY_WIRING_ERROR,
+    REPLY_CAN_ERROR,
+    REPLY_BUFFER_FULL,
+    REPLY_STOPPED
 };
 
 // Protocols
@@ -45,12 +48,20 @@ enum AdapterTypes {
    ADPTR_CAN_EXT
 };
 
+// Loopback self-test results
+//
+struct LoopbackStats {
+    uint32_t sent;     // Frames transmitted
+    uint32_t received; // Frames passed through ring, history and formatter
+    uint32_t elapsed;  // Test time, microseconds
+};
+
 class ProtocolAdapter {
 public:
     static ProtocolAdapter* getAdapter(int adapterType);
     virtual int onConnectEcu() = 0;
     virtual int onTryConnectEcu(bool sendReply) = 0;
-    virtual int onRequest(const uint8_t* data, int len) = 0;
+    virtual int onRequest(const uint8_t* data, int len, int numOfResp) = 0;
     virtual void getDescription() = 0;
     virtual void getDescriptionNum() = 0;
     virtual void dumpBuffer() {}
@@ -58,6 +69,10 @@ public:
     virtual void open() { connected_ = false; }
     virtual void close();
     virtual void wiringCheck() = 0;
+    virtual int monitor() { return REPLY_CMD_WRONG; }
+    virtual int sendRtr() { return REPLY_CMD_WRONG; }
+    virtual int batchPids(const uint8_t* pids, int num) { return REPLY_CMD_WRONG; }
+    virtual void loopbackTest(uint32_t frameNum, uint8_t dlc, LoopbackStats& stats) {}
     virtual void sendHeartBeat() {}
     virtual int getProtocol() const = 0;
     virtual void kwDisplay() {}
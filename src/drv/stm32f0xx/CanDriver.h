@@ -12,22 +12,93 @@
 
 using namespace std;
 
+// The receive ring depth, has to be a power of two (16/32/64)
+#ifndef CAN_RX_FIFO_LEN
+#define CAN_RX_FIFO_LEN 16
+#endif
+
+// The transmit queue depth, has to be a power of two
+#ifndef CAN_TX_FIFO_LEN
+#define CAN_TX_FIFO_LEN 4
+#endif
+
 typedef void *CAN_HANDLE_T;
 struct CanMsgBuffer;
 
+// Receive ring statistics
+struct CanRxStats {
+    uint32_t frames;    // Frames stored into the ring
+    uint32_t overflows; // Frames dropped, the ring was full
+    uint32_t overruns;  // Hardware FIFO overruns, the frames lost
+    uint32_t highWater; // The max ring occupancy seen
+};
+
+// Transmit queue statistics
+struct CanTxStats {
+    uint32_t frames; // Frames transmitted
+    uint32_t errors; // Frames failed or aborted
+};
+
+// Bus error statistics, the error interrupt events
+struct CanErrorStats {
+    uint32_t warnings;  // Error warning, TEC or REC reached 96
+    uint32_t passives;  // Error passive, TEC or REC reached 128
+    uint32_t busOffs;   // Bus-off, TEC reached 256
+    uint32_t lecErrors; // Stuff, form, ACK, bit and CRC errors
+    uint8_t  tec;       // TX error counter snapshot
+    uint8_t  rec;       // RX error counter snapshot
+    uint8_t  lec;       // The last error code
+};
+
+// Transmit completion callback, called from ISR
+typedef void (*CanTxCallbackT)(const CanMsgBuffer* msg, bool ok);
+
+// Standard bit rates, bit/s
+const uint32_t CAN_BR_33K3 = 33333;
+const uint32_t CAN_BR_50K  = 50000;
+const uint32_t CAN_BR_83K3 = 83333;
+const uint32_t CAN_BR_100K = 100000;
+const uint32_t CAN_BR_125K = 125000;
+const uint32_t CAN_BR_250K = 250000;
+const uint32_t CAN_BR_500K = 500000;
+const uint32_t CAN_BR_1M   = 1000000;
+
 class CanDriver {
 public:
+    const static uint8_t FIFO0 = 0; // Diagnostic responses
+    const static uint8_t FIFO1 = 1; // Monitored traffic
     static CanDriver* instance();
     static void configure();
     bool send(const CanMsgBuffer* buff);
-    bool setFilterAndMask(uint32_t filter, uint32_t mask, bool extended);
+    bool isTxPending() const;
+    bool isTxFull() const;
+    void abortTx();
+    void setTxCallback(CanTxCallbackT callback);
+    void getTxStats(CanTxStats& stats) const;
+    bool setFilterAndMask(uint32_t filter, uint32_t mask, bool extended, uint8_t fifo = FIFO0);
+    bool setFilterFifo(uint32_t filterNum, uint8_t fifo);
+    bool setBitRate(uint32_t rate);
+    uint32_t getBitRate() const;
+    bool setSilent(bool val);
+    bool isSilent() const;
+    bool setLoopback(bool val);
+    uint32_t detectBitRate(const uint32_t* rates, int num, uint32_t window);
     bool isReady() const;
     bool read(CanMsgBuffer* buff);
+    const CanMsgBuffer* peek(int& count) const;
+    void consume(int count);
     bool wakeUp();
     bool sleep();
     void setBitBang(bool val);
     void setBit(uint32_t val);
     uint32_t getBit();
+    void getRxStats(CanRxStats& stats) const;
+    void resetRxStats();
+    uint32_t getOverflowCount() const;
+    void getErrorStats(CanErrorStats& stats) const;
+    void resetErrorStats();
+    bool isBusOff() const;
+    uint8_t getTxErrorCount() const;
     static CAN_HANDLE_T handle_;
 private:
     CanDriver();
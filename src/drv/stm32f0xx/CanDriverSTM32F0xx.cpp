@@ -10,7 +10,9 @@
 #include <adaptertypes.h>
 #include "cortexm.h"
 #include "CanDriver.h"
+#include "CanFilter.h"
 #include "GPIODrv.h"
+#include "Timer.h"
 #include <canmsgbuffer.h>
 #include <led.h>
 
@@ -23,32 +25,280 @@ const int CanRxPort = 0;
 const int CanTxPort = 0;
 const int CAN_AF = GPIO_AF_4;
 
-const int CAN_PRESCALER = 6 ; // For bus clock 48Mhz
+// Bit timing, 16 time quanta per bit: SYNC + BS1 + BS2, sample point at 81.25%
+const uint32_t CAN_CLOCK  = 48000000; // APB clock, SystemCoreClock at 48Mhz
+const uint32_t CAN_TQ_NUM = 16;
+const uint32_t CAN_BS1_TQ = 12;
+const uint32_t CAN_BS2_TQ = 3;
+const uint32_t CAN_SJW_TQ = 3;
+
+// Bit rate detection, frames or errors to decide before the window ends
+const uint32_t DETECT_FRAMES = 3;
+const uint32_t DETECT_ERRORS = 3;
 const uint32_t FMR_FINIT = 0x00000001;
 const uint32_t MCR_DBF   = 0x00010000;
+const uint32_t CAN_FILTER_NUM = 14; // bxCAN filter banks
 static GPIO_TypeDef* const GPIOPtr[] = { GPIOA, GPIOB, GPIOC };
 
+/**
+ * Compose BTR register value
+ */
+constexpr uint32_t BitTiming(uint32_t prescaler, uint32_t bs1, uint32_t bs2, uint32_t sjw)
+{
+    return ((sjw - 1) << 24) | ((bs2 - 1) << 20) | ((bs1 - 1) << 16) | (prescaler - 1);
+}
+
+/**
+ * The rounded prescaler for the bit rate with CAN_TQ_NUM time quanta
+ */
+constexpr uint32_t Prescaler(uint32_t rate)
+{
+    return (CAN_CLOCK + (rate * CAN_TQ_NUM) / 2) / (rate * CAN_TQ_NUM);
+}
+
+constexpr uint32_t StdBitTiming(uint32_t rate)
+{
+    return BitTiming(Prescaler(rate), CAN_BS1_TQ, CAN_BS2_TQ, CAN_SJW_TQ);
+}
+
+struct BitRateEntry {
+    uint32_t rate;
+    uint32_t btr;
+};
+
+// Built at compile time from CAN_CLOCK
+static const BitRateEntry BitRates[] = {
+    { CAN_BR_33K3, StdBitTiming(CAN_BR_33K3) },
+    { CAN_BR_50K,  StdBitTiming(CAN_BR_50K)  },
+    { CAN_BR_83K3, StdBitTiming(CAN_BR_83K3) },
+    { CAN_BR_100K, StdBitTiming(CAN_BR_100K) },
+    { CAN_BR_125K, StdBitTiming(CAN_BR_125K) },
+    { CAN_BR_250K, StdBitTiming(CAN_BR_250K) },
+    { CAN_BR_500K, StdBitTiming(CAN_BR_500K) },
+    { CAN_BR_1M,   StdBitTiming(CAN_BR_1M)   }
+};
+static_assert(Prescaler(CAN_BR_1M) * CAN_TQ_NUM * CAN_BR_1M == CAN_CLOCK, "CAN clock is not supported");
+
+static uint32_t BitRate = CAN_BR_500K;
+
+
+// Receive ring, single producer (CAN ISR) and single consumer (main loop).
+// The indexes are free running, the slot is (index & RX_RING_MASK)
+const uint32_t RX_RING_MASK = CAN_RX_FIFO_LEN - 1;
+static_assert((CAN_RX_FIFO_LEN & RX_RING_MASK) == 0, "CAN_RX_FIFO_LEN has to be a power of two");
+static CanMsgBuffer RxRing[CAN_RX_FIFO_LEN];
+static volatile uint32_t RxHead; // Written by ISR only
+static volatile uint32_t RxTail; // Written by main loop only
+static volatile uint32_t RxFrameCnt;
+static volatile uint32_t RxOverflowCnt;
+static volatile uint32_t RxOverrunCnt;
+static volatile uint32_t RxHighWater;
+
+// The ring slots FIFO1 frames can not use
+const uint32_t RX_FIFO1_RESERVE = CAN_RX_FIFO_LEN / 8;
+
+// Transmit queue, the slot is released when its mailbox is completed.
+// TxTail <= TxNext <= TxHead, [TxTail, TxNext) are in the mailboxes
+const uint32_t TX_RING_MASK = CAN_TX_FIFO_LEN - 1;
+static_assert((CAN_TX_FIFO_LEN & TX_RING_MASK) == 0, "CAN_TX_FIFO_LEN has to be a power of two");
+const int TX_MAILBOX_NUM = 3;
+static CanMsgBuffer TxRing[CAN_TX_FIFO_LEN];
+static volatile uint32_t TxHead; // Next slot to queue
+static volatile uint32_t TxNext; // Next slot to load into a mailbox
+static volatile uint32_t TxTail; // Next slot to complete
+static uint32_t MailboxSeq[TX_MAILBOX_NUM];
+static volatile uint32_t TxFrameCnt;
+static volatile uint32_t TxErrorCnt;
+static CanTxCallbackT TxCallback;
+
+// Error interrupt counters
+static volatile uint32_t ErrWarningCnt;
+static volatile uint32_t ErrPassiveCnt;
+static volatile uint32_t ErrBusOffCnt;
+static volatile uint32_t ErrLecCnt;
+static uint32_t ErrFlags; // EWGF, EPVF and BOFF seen by the last interrupt
+
+// Bit rate detection, the frames and errors are counted by ISR, not published
+static volatile bool Detecting;
+static volatile uint32_t DetectFrames;
+static volatile uint32_t DetectErrors;
+
+/**
+ * Copy the FIFO output mailbox to the message buffer
+ * @parameter   fifo   The FIFO number, CAN_FIFO0 or CAN_FIFO1
+ * @parameter   msg    CanMsgBuffer instance
+ */
+static void ReadMailbox(uint8_t fifo, CanMsgBuffer* msg)
+{
+    const CAN_FIFOMailBox_TypeDef* mailbox = &CAN->sFIFOMailBox[fifo];
+    uint32_t rir  = mailbox->RIR;
+    uint32_t rdtr = mailbox->RDTR;
+    uint32_t rdlr = mailbox->RDLR;
+    uint32_t rdhr = mailbox->RDHR;
+
+    msg->timestamp = MicroTimer::now();
+    msg->extended = (rir & CAN_ID_EXT);
+    msg->rtr = (rir & CAN_RTR_Remote);
+    msg->id = msg->extended ? (rir >> 3) : (rir >> 21);
+    msg->dlc = rdtr & 0x0F;
+    msg->msgnum = (rdtr >> 8) & 0xFF; // Filter match index
+    if (msg->rtr) { // No data bytes in the remote frame
+        rdlr = rdhr = 0;
+    }
+    memcpy(msg->data, &rdlr, 4);
+    memcpy(msg->data + 4, &rdhr, 4);
+}
+
+/**
+ * Move all the pending frames from the hardware FIFO to the receive ring
+ * @parameter   fifo     The FIFO number, CAN_FIFO0 or CAN_FIFO1
+ * @parameter   reserve  The number of ring slots to keep free for the other FIFO
+ */
+static void DrainFifo(uint8_t fifo, uint32_t reserve)
+{
+    volatile uint32_t* rfr = (fifo == CAN_FIFO0) ? &CAN->RF0R : &CAN->RF1R;
+    const CanFilterTable* filters = CanFilterTable::instance();
+
+    while (*rfr & CAN_RF0R_FMP0) {
+        if (Detecting) { // Only counted, the frame at the candidate bit rate
+            DetectFrames++;
+            *rfr = CAN_RF0R_RFOM0;
+            continue;
+        }
+        uint32_t head = RxHead;
+        uint32_t used = head - RxTail;
+        if (used < (CAN_RX_FIFO_LEN - reserve)) {
+            CanMsgBuffer* msg = &RxRing[head & RX_RING_MASK];
+            ReadMailbox(fifo, msg);
+            if (!filters->isBlocked(msg->id, msg->extended)) {
+                __DMB(); // The slot has to be written before it is published
+                RxHead = head + 1;
+                RxFrameCnt++;
+                if (++used > RxHighWater)
+                    RxHighWater = used;
+            }
+        }
+        else {
+            RxOverflowCnt++; // The ring is full, drop the frame
+        }
+        *rfr = CAN_RF0R_RFOM0; // Release the output mailbox
+    }
+}
+
+/**
+ * Load the queued frames to the empty mailboxes, called with interrupts masked
+ */
+static void LoadMailboxes()
+{
+    while (TxNext != TxHead) {
+        uint32_t tsr = CAN->TSR;
+        if ((tsr & CAN_TSR_TME) == 0)
+            break; // All mailboxes are busy
+
+        uint32_t mailboxNum = (tsr & CAN_TSR_CODE) >> 24; // Next empty mailbox
+        const CanMsgBuffer* msg = &TxRing[TxNext & TX_RING_MASK];
+        CAN_TxMailBox_TypeDef* mailbox = &CAN->sTxMailBox[mailboxNum];
+        uint32_t tdlr, tdhr;
+        memcpy(&tdlr, msg->data, 4);
+        memcpy(&tdhr, msg->data + 4, 4);
+
+        mailbox->TIR  = (msg->extended ? ((msg->id << 3) | CAN_ID_EXT) : (msg->id << 21))
+                      | (msg->rtr ? CAN_RTR_Remote : CAN_RTR_Data);
+        mailbox->TDTR = msg->dlc & 0x0F;
+        mailbox->TDLR = tdlr;
+        mailbox->TDHR = tdhr;
+        MailboxSeq[mailboxNum] = TxNext++;
+        mailbox->TIR |= CAN_TI0R_TXRQ; // Request the transmission
+    }
+}
 
-// FIFO stuff
-const int FIFO_NUM = 10;
-static CanRxMsg RxFifo[FIFO_NUM];
-static volatile uint32_t RxFifoFlag;
-static volatile uint32_t FifoReadPos;
-static volatile uint32_t FifoWritePos;
+/**
+ * Complete the finished mailboxes in the queue order and refill them
+ */
+static void ServiceMailboxes()
+{
+    for (;;) {
+        uint32_t tsr = CAN->TSR;
+        int mailboxNum = -1;
+
+        // TXFP mode, the oldest request completes first
+        for (int i = 0; i < TX_MAILBOX_NUM; i++) {
+            if ((tsr & (CAN_TSR_RQCP0 << (i * 8))) == 0)
+                continue;
+            if (mailboxNum < 0 || (MailboxSeq[i] - TxTail) < (MailboxSeq[mailboxNum] - TxTail))
+                mailboxNum = i;
+        }
+        if (mailboxNum < 0)
+            break;
+
+        bool ok = tsr & (CAN_TSR_TXOK0 << (mailboxNum * 8));
+        CAN->TSR = CAN_TSR_RQCP0 << (mailboxNum * 8); // Clears RQCP, TXOK, ALST and TERR
+        if (ok)
+            TxFrameCnt++;
+        else
+            TxErrorCnt++;
+        if (TxCallback) {
+            (*TxCallback)(&TxRing[MailboxSeq[mailboxNum] & TX_RING_MASK], ok);
+        }
+        TxTail = MailboxSeq[mailboxNum] + 1;
+    }
+    LoadMailboxes();
+}
 
+/**
+ * Count the error status changes and the last error code events
+ */
+static void ServiceErrors()
+{
+    uint32_t esr = CAN->ESR;
+    uint32_t raised = esr & ~ErrFlags;
+    ErrFlags = esr & (CAN_ESR_EWGF | CAN_ESR_EPVF | CAN_ESR_BOFF);
+
+    if (raised & CAN_ESR_EWGF)
+        ErrWarningCnt++;
+    if (raised & CAN_ESR_EPVF)
+        ErrPassiveCnt++;
+    if (raised & CAN_ESR_BOFF)
+        ErrBusOffCnt++;
+
+    uint32_t lec = esr & CAN_ESR_LEC;
+    if (lec != 0 && lec != CAN_ESR_LEC) {
+        if (Detecting)
+            DetectErrors++; // The wrong bit rate, not the bus error
+        else
+            ErrLecCnt++;
+    }
+    CAN->ESR = CAN_ESR_LEC;  // 7, the next status change does not count it again
+    CAN->MSR = CAN_MSR_ERRI; // Clear the error interrupt
+}
 
 extern "C" void CEC_CAN_IRQHandler(void)
 {
-    // Blink LED from here, when RX operation is completed
-    AdptLED::instance()->blinkRx();
+    const uint32_t TSR_RQCP = CAN_TSR_RQCP0 | CAN_TSR_RQCP1 | CAN_TSR_RQCP2;
 
-    CanRxMsg* msg = &RxFifo[FifoWritePos];
-    CAN_Receive(CAN, CAN_FIFO0, msg);
+    if (CAN->RF0R & CAN_RF0R_FMP0 || CAN->RF1R & CAN_RF1R_FMP1) {
+        // Blink LED from here, when RX operation is completed
+        AdptLED::instance()->blinkRx();
 
-    // Advance the FIFO next writing position
-    uint32_t mask = 0x1 << FifoWritePos;
-    RxFifoFlag |= mask;
-    FifoWritePos = (FifoWritePos == FIFO_NUM-1) ? 0 : FifoWritePos + 1;
+        // FIFO0 first, the monitored traffic from FIFO1 could not
+        // take the last ring slots needed for diagnostic responses
+        DrainFifo(CAN_FIFO0, 0);
+        DrainFifo(CAN_FIFO1, RX_FIFO1_RESERVE);
+    }
+    if (CAN->RF0R & CAN_RF0R_FOVR0) { // The frames came while ISR was blocked
+        CAN->RF0R = CAN_RF0R_FOVR0;
+        RxOverrunCnt++;
+    }
+    if (CAN->RF1R & CAN_RF1R_FOVR1) {
+        CAN->RF1R = CAN_RF1R_FOVR1;
+        RxOverrunCnt++;
+    }
+    if (CAN->TSR & TSR_RQCP) {
+        ServiceMailboxes();
+    }
+    if (CAN->MSR & CAN_MSR_ERRI) {
+        ServiceErrors();
+    }
 }
 
 /**
@@ -65,6 +315,41 @@ static void configureCANPins()
     GPIO_Init(GPIOA, &GPIO_InitStruct);
 }
 
+/**
+ * Find BTR value for the bit rate. The standard rates are from the table,
+ * the others (ATPB) are searched for the closest to 16 time quanta
+ * @parameter   rate   The bit rate, bit/s
+ * @parameter   btr    BTR register value
+ * @return  true if found, false if the rate is not supported
+ */
+static bool GetBitTiming(uint32_t rate, uint32_t& btr)
+{
+    if (rate == 0)
+        return false;
+
+    for (const BitRateEntry& entry : BitRates) {
+        if (entry.rate == rate) {
+            btr = entry.btr;
+            return true;
+        }
+    }
+    
+    uint32_t total = (CAN_CLOCK + rate / 2) / rate; // prescaler * time quanta
+    for (uint32_t i = 0; i <= 16; i++) {
+        uint32_t tq = (i & 1) ? (CAN_TQ_NUM - (i + 1) / 2) : (CAN_TQ_NUM + i / 2);
+        if (tq < 8 || (total % tq) != 0)
+            continue;
+        uint32_t prescaler = total / tq;
+        uint32_t bs2 = (tq + 2) / 5; // ~80% sample point
+        uint32_t bs1 = tq - 1 - bs2;
+        if (prescaler > 1024 || bs1 > 16 || bs2 > 8)
+            continue;
+        btr = BitTiming(prescaler, bs1, bs2, (bs2 < CAN_SJW_TQ) ? bs2 : CAN_SJW_TQ);
+        return true;
+    }
+    return false;
+}
+
 /**
  * Configuring CanDriver
  */
@@ -84,24 +369,37 @@ void CanDriver::configure()
     // Configure these CAN pins in alternate function mode
     configureCANPins();
 
+    // The same timing as setBitRate, the default rate could be non-standard
+    uint32_t btr = 0;
+    if (!GetBitTiming(BitRate, btr)) {
+        BitRate = CAN_BR_500K;
+        GetBitTiming(BitRate, btr);
+    }
+
     CAN_InitTypeDef CAN_InitStruct;
     CAN_DeInit(CAN);
     CAN_StructInit(&CAN_InitStruct);
-    CAN_InitStruct.CAN_Prescaler = CAN_PRESCALER; // Specifies the length of a time quantum. It ranges from 1 to 1024.
+    CAN_InitStruct.CAN_Prescaler = (btr & 0x3FF) + 1; // Specifies the length of a time quantum. It ranges from 1 to 1024.
     CAN_InitStruct.CAN_Mode = CAN_Mode_Normal; // Specifies the CAN operating mode.
-    CAN_InitStruct.CAN_SJW = CAN_SJW_3tq;      // Specifies the synchronization jump
-    CAN_InitStruct.CAN_BS1 = CAN_BS1_12tq;     // Specifies the number of time quanta in Bit Segment 1.
-    CAN_InitStruct.CAN_BS2 = CAN_BS2_3tq;      // Specifies the number of time quanta in Bit Segment 2.
+    CAN_InitStruct.CAN_SJW = (btr >> 24) & 0x03; // Specifies the synchronization jump
+    CAN_InitStruct.CAN_BS1 = (btr >> 16) & 0x0F; // Specifies the number of time quanta in Bit Segment 1.
+    CAN_InitStruct.CAN_BS2 = (btr >> 20) & 0x07; // Specifies the number of time quanta in Bit Segment 2.
     CAN_InitStruct.CAN_TTCM = DISABLE;         // Enable or disable the time triggered communication mode.
     CAN_InitStruct.CAN_ABOM = ENABLE;          // Enable or disable the automatic bus-off management.
     CAN_InitStruct.CAN_AWUM = DISABLE;         // Enable or disable the automatic wake-up mode.
     CAN_InitStruct.CAN_NART = DISABLE;         // Enable or disable the non-automatic retransmission mode.
     CAN_InitStruct.CAN_RFLM = DISABLE;         // Enable or disable the Receive FIFO Locked mode.
-    CAN_InitStruct.CAN_TXFP = DISABLE;         // Enable or disable the transmit FIFO priority.
+    CAN_InitStruct.CAN_TXFP = ENABLE;          // Transmit in the request order
     CAN_Init(CAN, &CAN_InitStruct);
 
-    // Enable FIFO 0 message pending Interrupt
-    CAN_ITConfig(CAN, CAN_IT_FMP0, ENABLE);
+    // Enable FIFO 0 and FIFO 1 message pending and TX mailbox empty Interrupts
+    CAN_ITConfig(CAN, CAN_IT_FMP0 | CAN_IT_FMP1 | CAN_IT_TME, ENABLE);
+    
+    // FIFO 0 and FIFO 1 overrun Interrupts
+    CAN_ITConfig(CAN, CAN_IT_FOV0 | CAN_IT_FOV1, ENABLE);
+    
+    // Error warning, error passive, bus-off and last error code Interrupts
+    CAN_ITConfig(CAN, CAN_IT_EWG | CAN_IT_EPV | CAN_IT_BOF | CAN_IT_LEC | CAN_IT_ERR, ENABLE);
 
     CAN->ESR = 0; 
     
@@ -119,6 +417,146 @@ CanDriver* CanDriver::instance()
     return &instance;
 }
 
+/**
+ * Switch the bit rate, the controller goes through the initialization mode
+ * @parameter   rate   The bit rate, bit/s
+ * @return  true if OK, false if the rate is not supported or mode switch failed
+ */
+bool CanDriver::setBitRate(uint32_t rate)
+{
+    uint32_t btr = 0;
+    if (!GetBitTiming(rate, btr))
+        return false;
+    if (rate == BitRate)
+        return true;
+
+    abortTx();
+    if (CAN_OperatingModeRequest(CAN, CAN_OperatingMode_Initialization) != CAN_ModeStatus_Success)
+        return false;
+
+    // Keep the test mode bits
+    CAN->BTR = (CAN->BTR & (CAN_BTR_SILM | CAN_BTR_LBKM)) | btr;
+    BitRate = rate;
+
+    return CAN_OperatingModeRequest(CAN, CAN_OperatingMode_Normal) == CAN_ModeStatus_Success;
+}
+
+/**
+ * Get the current bit rate
+ * @return  The bit rate, bit/s
+ */
+uint32_t CanDriver::getBitRate() const
+{
+    return BitRate;
+}
+
+/**
+ * Silent mode, the controller receives but does not send ACK or error frames
+ * @parameter   val   true to listen only
+ * @return  true if OK, false if mode switch failed
+ */
+bool CanDriver::setSilent(bool val)
+{
+    if (val) {
+        abortTx();
+    }
+    if (CAN_OperatingModeRequest(CAN, CAN_OperatingMode_Initialization) != CAN_ModeStatus_Success)
+        return false;
+
+    CAN->BTR = val ? (CAN->BTR | CAN_BTR_SILM) : (CAN->BTR & ~CAN_BTR_SILM);
+
+    return CAN_OperatingModeRequest(CAN, CAN_OperatingMode_Normal) == CAN_ModeStatus_Success;
+}
+
+/**
+ * Silent loopback mode for the self-test, the transmitted frames are received
+ * internally and the bus is not touched
+ * @parameter   val   true to enable
+ * @return  true if OK, false if mode switch failed
+ */
+bool CanDriver::setLoopback(bool val)
+{
+    const uint32_t testMode = CAN_BTR_SILM | CAN_BTR_LBKM;
+
+    abortTx();
+    if (CAN_OperatingModeRequest(CAN, CAN_OperatingMode_Initialization) != CAN_ModeStatus_Success)
+        return false;
+
+    CAN->BTR = val ? (CAN->BTR | testMode) : (CAN->BTR & ~testMode);
+
+    return CAN_OperatingModeRequest(CAN, CAN_OperatingMode_Normal) == CAN_ModeStatus_Success;
+}
+
+/**
+ * Check the silent mode
+ * @return  true if listen only
+ */
+bool CanDriver::isSilent() const
+{
+    return (CAN->BTR & CAN_BTR_SILM) != 0;
+}
+
+/**
+ * Find the bus bit rate without transmitting, listen to each candidate in
+ * silent mode and count the frames received OK against the last error code hits.
+ * Both are counted by the CAN interrupt, the main loop sleeps in WFI
+ * @parameter   rates   The candidate bit rates, the most probable first
+ * @parameter   num     The number of candidates
+ * @parameter   window  Listen time for one candidate, ms
+ * @return  The bit rate detected, 0 if no traffic or all candidates failed
+ */
+uint32_t CanDriver::detectBitRate(const uint32_t* rates, int num, uint32_t window)
+{
+    uint32_t detected = 0;
+    bool silent = isSilent();
+    Timer* timer = Timer::instance(Timer::TIMER0);
+
+    // Open the protocol filter, any frame counts
+    uint32_t fr1 = CAN->sFilterRegister[0].FR1;
+    uint32_t fr2 = CAN->sFilterRegister[0].FR2;
+    uint32_t ffa = CAN->FFA1R;
+    setFilterAndMask(0, 0, false);
+
+    setSilent(true);
+    for (int i = 0; i < num && detected == 0; i++) {
+        if (!setBitRate(rates[i]))
+            continue;
+
+        DetectFrames = 0;
+        DetectErrors = 0;
+        CAN->ESR = CAN_ESR_LEC; // 7, no bus activity since the last read
+        Detecting = true;
+        timer->start(window);
+        while (!timer->isExpired() && DetectFrames < DETECT_FRAMES && DetectErrors < DETECT_ERRORS) {
+            // Checked with the interrupts masked, the pending interrupt wakes up WFI
+            uint32_t primask = __get_PRIMASK();
+            __disable_irq();
+            if (!timer->isExpired() && DetectFrames < DETECT_FRAMES && DetectErrors < DETECT_ERRORS) {
+                __WFI();
+            }
+            __set_PRIMASK(primask);
+        }
+        Detecting = false;
+        if (DetectFrames > DetectErrors) {
+            detected = rates[i];
+        }
+    }
+    setSilent(silent);
+
+    // Restore the protocol filter
+    CAN->FMR |= FMR_FINIT;
+    CAN->FA1R &= ~1;
+    CAN->sFilterRegister[0].FR1 = fr1;
+    CAN->sFilterRegister[0].FR2 = fr2;
+    CAN->FFA1R = ffa;
+    CAN->FA1R |= 1;
+    CAN->FMR &= ~FMR_FINIT;
+
+    // Drop the frames received before listening
+    RxTail = RxHead;
+    return detected;
+}
+
 /**
  * Intialize the CAN controller and interrupt handler
  */
@@ -130,33 +568,80 @@ CanDriver::CanDriver()
 }
 
 /**
- * Transmits a sequence of bytes to the ECU over CAN bus
+ * Queue the frame for transmission, the call does not wait for completion
  * @parameter   buff   CanMsgBuffer instance
- * @return the send operation completion status
+ * @return true if queued, false if the transmit queue is full
  */
 bool CanDriver::send(const CanMsgBuffer* buff)
 {   
     // Blink LED from here, when TX operation is completed
     AdptLED::instance()->blinkTx();
 
-    CanTxMsg msg;
-    msg.StdId = msg.ExtId = buff->id;
-    msg.IDE   = buff->extended ? CAN_ID_EXT : CAN_ID_STD;
-    msg.RTR   = CAN_RTR_Data;
-    msg.DLC   = buff->dlc;
-    memcpy(msg.Data, buff->data, 8);
-    
-    uint8_t mailboxNum = CAN_Transmit(CAN, &msg);
-    if (mailboxNum != CAN_TxStatus_NoMailBox) {
-        uint32_t tuplePos = mailboxNum * 8;
-        volatile uint32_t tuple = 0;
-        do {
-            tuple = (CAN->TSR >> tuplePos) & 0x0F;
-        } while ((tuple & 0x01) == 0);
-        
-        return (tuple & 0x02); // 0x03 -> success (RQCP and TXOK set), other -> error
+    // The queue is shared with CAN ISR and could be used by other ISRs
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    bool queued = (TxHead - TxTail) < CAN_TX_FIFO_LEN;
+    if (queued) {
+        TxRing[TxHead & TX_RING_MASK] = *buff;
+        TxHead = TxHead + 1;
+        LoadMailboxes();
     }
-    return false; // No empty mailbox!
+
+    __set_PRIMASK(primask);
+    return queued;
+}
+
+/**
+ * Check the transmit queue status
+ * @return true if any frame is queued or in a mailbox
+ */
+bool CanDriver::isTxPending() const
+{
+    return (TxHead != TxTail);
+}
+
+/**
+ * Check the transmit queue space
+ * @return true if no more frames could be queued
+ */
+bool CanDriver::isTxFull() const
+{
+    return (TxHead - TxTail) >= CAN_TX_FIFO_LEN;
+}
+
+/**
+ * Abort all the pending transmissions and drop the queued frames
+ */
+void CanDriver::abortTx()
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    TxErrorCnt += TxHead - TxNext;
+    TxHead = TxNext; // Drop the frames not loaded yet
+    CAN->TSR = CAN_TSR_ABRQ0 | CAN_TSR_ABRQ1 | CAN_TSR_ABRQ2;
+
+    __set_PRIMASK(primask); // The aborted mailboxes complete in ISR
+}
+
+/**
+ * Set the transmit completion callback
+ * @parameter   callback   The callback, called from ISR
+ */
+void CanDriver::setTxCallback(CanTxCallbackT callback)
+{
+    TxCallback = callback;
+}
+
+/**
+ * Get the transmit queue statistics
+ * @parameter   stats   The statistics output
+ */
+void CanDriver::getTxStats(CanTxStats& stats) const
+{
+    stats.frames = TxFrameCnt;
+    stats.errors = TxErrorCnt;
 }
 
 /**
@@ -164,9 +649,10 @@ bool CanDriver::send(const CanMsgBuffer* buff)
  * @parameter   filter    CAN filter value
  * @parameter   mask      CAN mask value
  * @parameter   extended  CAN extended message flag
+ * @parameter   fifo      The FIFO to route the matching frames to
  * @return  the operation completion status
  */
-bool CanDriver::setFilterAndMask(uint32_t filter, uint32_t mask, bool extended)
+bool CanDriver::setFilterAndMask(uint32_t filter, uint32_t mask, bool extended, uint8_t fifo)
 {
     const uint32_t filterNum = 0;
     const uint32_t filterNumberBitPos = 1 << filterNum;
@@ -184,8 +670,11 @@ bool CanDriver::setFilterAndMask(uint32_t filter, uint32_t mask, bool extended)
     // STDID[10:0], EXTID[17:0], IDE and RTR bits.
     CAN->sFilterRegister[filterNum].FR1 = extended ? ((filter << 3) | 0x0000004) : (filter << 21);
 
-    // FIFO 0 assignation for the filter
-    CAN->FFA1R &= ~filterNumberBitPos;
+    // FIFO assignation for the filter
+    if (fifo == FIFO1)
+        CAN->FFA1R |= filterNumberBitPos;
+    else
+        CAN->FFA1R &= ~filterNumberBitPos;
     
     // 32-bit mask
     // STDID[10:0], EXTID[17:0], IDE and RTR bits.
@@ -204,30 +693,71 @@ bool CanDriver::setFilterAndMask(uint32_t filter, uint32_t mask, bool extended)
 }
 
 /**
- * Read the CAN frame from FIFO buffer
+ * Route the filter bank matches to FIFO0 or FIFO1
+ * @parameter   filterNum  The filter bank number
+ * @parameter   fifo       FIFO0 or FIFO1
+ * @return  the operation completion status
+ */
+bool CanDriver::setFilterFifo(uint32_t filterNum, uint8_t fifo)
+{
+    if (filterNum >= CAN_FILTER_NUM || fifo > FIFO1)
+        return false;
+
+    const uint32_t filterNumberBitPos = 1 << filterNum;
+
+    // FFA1R is writable in the initialisation mode only
+    CAN->FMR |= FMR_FINIT;
+    if (fifo == FIFO1)
+        CAN->FFA1R |= filterNumberBitPos;
+    else
+        CAN->FFA1R &= ~filterNumberBitPos;
+    CAN->FMR &= ~FMR_FINIT;
+
+    return true;
+}
+
+/**
+ * Read the CAN frame from the receive ring
  * @return  true if read the frame / false if no frame
  */
 bool CanDriver::read(CanMsgBuffer* buff)
 { 
-    if (RxFifoFlag) {
-        const CanRxMsg* msg = &RxFifo[FifoReadPos];
-        buff->id = msg->IDE ? msg->ExtId : msg->StdId;
-        buff->extended = (msg->IDE == CAN_ID_EXT);
-        buff->dlc = msg->DLC;
-        memcpy(buff->data, msg->Data, 8);
-
-        // Advance the FIFO next reading position
-        uint32_t mask = 0x1 << FifoReadPos;
-
-        CAN_ITConfig(CAN, CAN_IT_FMP0, DISABLE);
-        RxFifoFlag &= ~mask;
-        CAN_ITConfig(CAN, CAN_IT_FMP0, ENABLE);
-        FifoReadPos = (FifoReadPos == FIFO_NUM-1) ? 0 : FifoReadPos + 1;        
-        return true;
-    }
-    else {
+    uint32_t tail = RxTail;
+    if (tail == RxHead)
         return false;
-    }
+
+    *buff = RxRing[tail & RX_RING_MASK];
+    __DMB(); // The slot has to be read before it is released
+    RxTail = tail + 1;
+    return true;
+}
+
+/**
+ * Get the ready frames in place, up to the ring end. The slots stay owned
+ * by the caller until consume()
+ * @parameter   count  The number of the frames returned
+ * @return  The pointer to the first frame
+ */
+const CanMsgBuffer* CanDriver::peek(int& count) const
+{
+    uint32_t tail = RxTail;
+    uint32_t ready = RxHead - tail;
+    uint32_t slot = tail & RX_RING_MASK;
+    uint32_t toEnd = CAN_RX_FIFO_LEN - slot;
+
+    __DMB(); // The slots are read after the head
+    count = (ready < toEnd) ? ready : toEnd;
+    return &RxRing[slot];
+}
+
+/**
+ * Release the frames returned by peek()
+ * @parameter   count  The number of the frames to release
+ */
+void CanDriver::consume(int count)
+{
+    __DMB(); // The slots have to be read before they are released
+    RxTail = RxTail + count;
 }
 
 /**
@@ -236,7 +766,79 @@ bool CanDriver::read(CanMsgBuffer* buff)
  */
 bool CanDriver::isReady() const
 {
-     return (RxFifoFlag != 0x0);
+     return (RxTail != RxHead);
+}
+
+/**
+ * Get the receive ring statistics
+ * @parameter   stats   The statistics output
+ */
+void CanDriver::getRxStats(CanRxStats& stats) const
+{
+    stats.frames    = RxFrameCnt;
+    stats.overflows = RxOverflowCnt;
+    stats.overruns  = RxOverrunCnt;
+    stats.highWater = RxHighWater;
+}
+
+/**
+ * Clear the receive ring statistics
+ */
+void CanDriver::resetRxStats()
+{
+    RxFrameCnt = RxOverflowCnt = RxOverrunCnt = 0;
+    RxHighWater = RxHead - RxTail; // Current occupancy
+}
+
+/**
+ * The frames lost in the receive ring and in the hardware FIFOs
+ * @return  The overflow count
+ */
+uint32_t CanDriver::getOverflowCount() const
+{
+    return RxOverflowCnt + RxOverrunCnt;
+}
+
+/**
+ * Get the bus error statistics with TEC/REC snapshot
+ * @parameter   stats   The statistics
+ */
+void CanDriver::getErrorStats(CanErrorStats& stats) const
+{
+    uint32_t esr = CAN->ESR;
+    stats.warnings  = ErrWarningCnt;
+    stats.passives  = ErrPassiveCnt;
+    stats.busOffs   = ErrBusOffCnt;
+    stats.lecErrors = ErrLecCnt;
+    stats.tec = (esr & CAN_ESR_TEC) >> 16;
+    stats.rec = (esr & CAN_ESR_REC) >> 24;
+    stats.lec = (esr & CAN_ESR_LEC) >> 4;
+}
+
+/**
+ * Reset the bus error counters
+ */
+void CanDriver::resetErrorStats()
+{
+    ErrWarningCnt = ErrPassiveCnt = ErrBusOffCnt = ErrLecCnt = 0;
+}
+
+/**
+ * Check for bus-off, the controller recovers by itself (ABOM)
+ * @return  true if bus-off
+ */
+bool CanDriver::isBusOff() const
+{
+    return (CAN->ESR & CAN_ESR_BOFF) != 0;
+}
+
+/**
+ * Get the transmit error counter
+ * @return  TEC value
+ */
+uint8_t CanDriver::getTxErrorCount() const
+{
+    return (CAN->ESR & CAN_ESR_TEC) >> 16;
 }
 
 /**
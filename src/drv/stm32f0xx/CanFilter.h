@@ -0,0 +1,53 @@
+/**
+ * See the file LICENSE for redistribution information.
+ *
+ * Copyright (c) 2009-2016 ObdDiag.Net. All rights reserved.
+ *
+ */
+
+#ifndef __CAN_FILTER_H__
+#define __CAN_FILTER_H__
+
+#include <cstdint>
+
+using namespace std;
+
+struct CanFilterEntry {
+    uint32_t id;   // CAN ID, FILTER_EXT bit set for 29 bit
+    uint32_t mask; // Exact match if all ID bits are set
+};
+
+//
+// Hardware acceptance filter table. Bank 0 belongs to the protocol
+// filter set by CanDriver::setFilterAndMask, the pass filters are packed
+// into the rest of the banks, active only while the bus is monitored. Block filters are applied by the receive
+// interrupt before the frame gets into the receive ring
+//
+class CanFilterTable {
+public:
+    const static uint32_t FILTER_EXT = 0x80000000;
+    const static int MAX_PASS_FILTERS  = 8;
+    const static int MAX_BLOCK_FILTERS = 4;
+    static CanFilterTable* instance();
+    bool addPass(uint32_t id, uint32_t mask, bool extended);
+    bool removePass(uint32_t id, uint32_t mask, bool extended);
+    void clearPass();
+    int getPassNum() const { return passNum_; }
+    const CanFilterEntry* getPass(int idx) const { return &pass_[idx]; }
+    bool addBlock(uint32_t id, uint32_t mask, bool extended);
+    void clearBlock();
+    int getBlockNum() const { return blockNum_; }
+    const CanFilterEntry* getBlock(int idx) const { return &block_[idx]; }
+    bool isBlocked(uint32_t id, bool extended) const;
+    void enablePass(bool val);
+private:
+    CanFilterTable();
+    bool apply();
+    CanFilterEntry pass_[MAX_PASS_FILTERS];
+    CanFilterEntry block_[MAX_BLOCK_FILTERS];
+    volatile int   passNum_;
+    volatile int   blockNum_;
+    bool           passEnabled_;
+};
+
+#endif //__CAN_FILTER_H__
@@ -0,0 +1,281 @@
+/**
+ * See the file LICENSE for redistribution information.
+ *
+ * Copyright (c) 2009-2016 ObdDiag.Net. All rights reserved.
+ *
+ */
+
+#include "cortexm.h"
+#include "CanDriver.h"
+#include "CanFilter.h"
+
+using namespace std;
+
+const uint32_t FIRST_BANK = 1;  // Bank 0 is the protocol filter
+const uint32_t LAST_BANK  = 13;
+const uint32_t PASS_BANKS = ((1 << (LAST_BANK + 1)) - 1) & ~((1 << FIRST_BANK) - 1);
+const uint32_t ID11_MASK  = 0x7FF;
+const uint32_t ID29_MASK  = 0x1FFFFFFF;
+const uint32_t IDE16      = 0x08; // IDE bit, 16-bit scale
+const uint32_t IDE32      = 0x04; // IDE bit, 32-bit scale
+
+// The bank layouts in allocation order
+enum FilterKind {
+    STD_LIST, // 16-bit list, four exact 11 bit IDs
+    STD_MASK, // 16-bit mask, two 11 bit ID/mask pairs
+    EXT_LIST, // 32-bit list, two exact 29 bit IDs
+    EXT_MASK, // 32-bit mask, one 29 bit ID/mask pair
+    KIND_NUM
+};
+
+static const uint8_t KindSlots[KIND_NUM] = { 4, 2, 2, 1 };
+
+/**
+ * Get the bank layout the filter entry fits to
+ * @param[in] entry The filter entry
+ * @return The filter kind
+ */
+static FilterKind GetKind(const CanFilterEntry& entry)
+{
+    if (entry.id & CanFilterTable::FILTER_EXT) {
+        return ((entry.mask & ID29_MASK) == ID29_MASK) ? EXT_LIST : EXT_MASK;
+    }
+    return ((entry.mask & ID11_MASK) == ID11_MASK) ? STD_LIST : STD_MASK;
+}
+
+/**
+ * Encode the filter entry to the bank register format
+ * @param[in] entry The filter entry
+ * @param[in] kind The bank layout
+ * @param[out] words The encoded values
+ */
+static void Encode(const CanFilterEntry& entry, FilterKind kind, uint32_t* words)
+{
+    switch (kind) {
+        case STD_LIST: // STDID[10:0], RTR, IDE, EXID[17:15]
+            words[0] = (entry.id & ID11_MASK) << 5;
+            break;
+        case STD_MASK:
+            words[0] = (((entry.mask & ID11_MASK) << 5) | IDE16) << 16 | ((entry.id & ID11_MASK) << 5);
+            break;
+        case EXT_LIST: // EXID[28:0], IDE, RTR, 0
+            words[0] = ((entry.id & ID29_MASK) << 3) | IDE32;
+            break;
+        case EXT_MASK:
+            words[0] = ((entry.id & ID29_MASK) << 3) | IDE32;
+            words[1] = ((entry.mask & ID29_MASK) << 3) | IDE32;
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Program and activate one filter bank, matches go to FIFO1
+ * @param[in] bank The bank number
+ * @param[in] kind The bank layout
+ * @param[in] words The encoded values, unused slots are the copies of the first one
+ * @return true if OK, false if out of banks
+ */
+static bool ProgramBank(uint32_t bank, FilterKind kind, const uint32_t* words)
+{
+    if (bank > LAST_BANK)
+        return false;
+
+    const uint32_t bankBitPos = 1 << bank;
+    bool listMode = (kind == STD_LIST || kind == EXT_LIST);
+    bool scale32  = (kind == EXT_LIST || kind == EXT_MASK);
+
+    if (kind == STD_LIST) {
+        CAN->sFilterRegister[bank].FR1 = (words[1] << 16) | words[0];
+        CAN->sFilterRegister[bank].FR2 = (words[3] << 16) | words[2];
+    }
+    else {
+        CAN->sFilterRegister[bank].FR1 = words[0];
+        CAN->sFilterRegister[bank].FR2 = words[1];
+    }
+    CAN->FM1R  = listMode ? (CAN->FM1R | bankBitPos) : (CAN->FM1R & ~bankBitPos);
+    CAN->FS1R  = scale32  ? (CAN->FS1R | bankBitPos) : (CAN->FS1R & ~bankBitPos);
+    CAN->FFA1R |= bankBitPos;
+    CAN->FA1R  |= bankBitPos;
+    return true;
+}
+
+/**
+ * CanFilterTable singleton
+ * @return The pointer to CanFilterTable instance
+ */
+CanFilterTable* CanFilterTable::instance()
+{
+    static CanFilterTable instance;
+    return &instance;
+}
+
+/**
+ * Construct the empty filter table
+ */
+CanFilterTable::CanFilterTable() : passNum_(0), blockNum_(0), passEnabled_(false)
+{
+}
+
+/**
+ * Reprogram the pass filter banks from the table
+ * @return true if OK, false if the table does not fit to the banks
+ */
+bool CanFilterTable::apply()
+{
+    bool sts = true;
+    uint32_t bank = FIRST_BANK;
+
+    // Initialisation mode for the filters
+    CAN->FMR |= CAN_FMR_FINIT;
+    CAN->FA1R &= ~PASS_BANKS;
+
+    for (int k = 0; k < KIND_NUM && sts; k++) {
+        FilterKind kind = static_cast<FilterKind>(k);
+        uint32_t words[4];
+        int slot = 0;
+
+        for (int i = 0; i < passNum_ && sts; i++) {
+            if (GetKind(pass_[i]) != kind)
+                continue;
+            Encode(pass_[i], kind, (kind == EXT_MASK) ? words : &words[slot]);
+            if (++slot == KindSlots[kind]) {
+                sts = ProgramBank(bank++, kind, words);
+                slot = 0;
+            }
+        }
+        if (slot > 0 && sts) { // The bank is not full, repeat the first entry
+            for (int i = slot; i < 4; i++) {
+                words[i] = words[0];
+            }
+            sts = ProgramBank(bank++, kind, words);
+        }
+    }
+
+    // The banks are programmed to check the layout, but the OBD requests
+    // should not see the pass filter frames
+    if (!passEnabled_) {
+        CAN->FA1R &= ~PASS_BANKS;
+    }
+
+    // Leave the initialisation mode for the filters
+    CAN->FMR &= ~CAN_FMR_FINIT;
+    return sts;
+}
+
+/**
+ * Activate the pass filter banks for the bus monitoring, deactivate after
+ * @param[in] val true to activate
+ */
+void CanFilterTable::enablePass(bool val)
+{
+    passEnabled_ = val;
+    apply();
+}
+
+/**
+ * Add the pass filter
+ * @param[in] id CAN ID
+ * @param[in] mask CAN mask, all ones for the exact match
+ * @param[in] extended CAN 29 bit flag
+ * @return true if OK, false if the table is full or no filter banks left
+ */
+bool CanFilterTable::addPass(uint32_t id, uint32_t mask, bool extended)
+{
+    uint32_t idMask = extended ? ID29_MASK : ID11_MASK;
+    CanFilterEntry entry = { (id & idMask) | (extended ? FILTER_EXT : 0), mask & idMask };
+
+    for (int i = 0; i < passNum_; i++) {
+        if (pass_[i].id == entry.id && pass_[i].mask == entry.mask)
+            return true; // Already there
+    }
+    if (passNum_ >= MAX_PASS_FILTERS)
+        return false;
+
+    pass_[passNum_++] = entry;
+    if (!apply()) {
+        passNum_--; // Does not fit, roll back
+        apply();
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Remove the pass filter
+ * @param[in] id CAN ID
+ * @param[in] mask CAN mask
+ * @param[in] extended CAN 29 bit flag
+ * @return true if removed, false if not found
+ */
+bool CanFilterTable::removePass(uint32_t id, uint32_t mask, bool extended)
+{
+    uint32_t idMask = extended ? ID29_MASK : ID11_MASK;
+    uint32_t entryId = (id & idMask) | (extended ? FILTER_EXT : 0);
+
+    for (int i = 0; i < passNum_; i++) {
+        if (pass_[i].id == entryId && pass_[i].mask == (mask & idMask)) {
+            for (int j = i + 1; j < passNum_; j++) {
+                pass_[j - 1] = pass_[j];
+            }
+            passNum_--;
+            apply();
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Remove all the pass filters and free the banks
+ */
+void CanFilterTable::clearPass()
+{
+    passNum_ = 0;
+    apply();
+}
+
+/**
+ * Add the block filter
+ * @param[in] id CAN ID
+ * @param[in] mask CAN mask, all ones for the exact match
+ * @param[in] extended CAN 29 bit flag
+ * @return true if OK, false if the table is full
+ */
+bool CanFilterTable::addBlock(uint32_t id, uint32_t mask, bool extended)
+{
+    if (blockNum_ >= MAX_BLOCK_FILTERS)
+        return false;
+
+    uint32_t idMask = extended ? ID29_MASK : ID11_MASK;
+    block_[blockNum_].id = (id & idMask) | (extended ? FILTER_EXT : 0);
+    block_[blockNum_].mask = mask & idMask;
+    blockNum_++; // Publish to the receive interrupt
+    return true;
+}
+
+/**
+ * Remove all the block filters
+ */
+void CanFilterTable::clearBlock()
+{
+    blockNum_ = 0;
+}
+
+/**
+ * Check the received frame against the block filters, called from ISR
+ * @param[in] id CAN ID
+ * @param[in] extended CAN 29 bit flag
+ * @return true if the frame has to be dropped
+ */
+bool CanFilterTable::isBlocked(uint32_t id, bool extended) const
+{
+    uint32_t entryId = id | (extended ? FILTER_EXT : 0);
+
+    for (int i = 0; i < blockNum_; i++) {
+        if (((entryId ^ block_[i].id) & (block_[i].mask | FILTER_EXT)) == 0)
+            return true;
+    }
+    return false;
+}
@@ -28,6 +28,7 @@ public:
     void ready(bool val) { ready_ = val; }
     void handler(UartRecvHandler handler) { handler_ = handler; }
     void enableReceive(bool val);
+    uint32_t getTxBytes() const { return txBytes_; }
 private:
     CmdUart();
     void txIrqHandler();
@@ -38,6 +39,7 @@ private:
     uint16_t        txLen_;
     uint16_t        txPos_;
     volatile bool   ready_;
+    volatile uint32_t txBytes_; // Bytes written to TDR, wraps
     UartRecvHandler handler_;
 };
 
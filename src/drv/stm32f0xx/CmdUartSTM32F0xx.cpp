@@ -28,6 +28,7 @@ CmdUart::CmdUart()
   : txLen_(0),
     txPos_(0),
     ready_(false),
+    txBytes_(0),
     handler_(0)
 {
 }
@@ -105,6 +106,7 @@ void CmdUart::txIrqHandler()
     if (txPos_ < txLen_) {
         if (USARTx->ISR & USART_FLAG_TXE) {
             USARTx->TDR = txData_[txPos_++];
+            txBytes_++;
         }
     }
     else {
@@ -153,6 +155,7 @@ void CmdUart::send(uint8_t ch)
     while ((USARTx->ISR & USART_FLAG_TXE) == 0)
         ;
     USARTx->TDR = ch;
+    txBytes_++;
 }
 
 /**
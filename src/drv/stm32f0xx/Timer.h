@@ -26,6 +26,7 @@ public:
 protected:
     Timer(int timerNum);
     TIM_TypeDef* timer_;
+    int          timerNum_;
 };
 
 class LongTimer : public Timer {
@@ -35,6 +36,13 @@ private:
     LongTimer();
 };
 
+// Free running 32-bit microsecond counter, wraps every 71 minutes
+class MicroTimer {
+public:
+    static uint32_t now() { return TIM2->CNT; }
+    static uint32_t elapsed(uint32_t since) { return TIM2->CNT - since; }
+};
+
 // For use with Rx/Tx LEDs
 typedef void (*PeriodicCallbackT)();
 class PeriodicTimer {
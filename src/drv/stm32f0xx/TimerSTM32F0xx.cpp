@@ -10,6 +10,36 @@
 
 const uint16_t tickDiv = (SystemCoreClock / 1000);
 static TIM_TypeDef*  TimerPtr[] = { TIM3, TIM14, TIM17 };
+static const IRQn_Type TimerIrq[] = { TIM3_IRQn, TIM14_IRQn, TIM17_IRQn };
+static volatile bool TimerExpired[3]; // Set by the update interrupt
+
+/**
+ * Single pulse timer update, mark it expired
+ * @param[in] timerNum Logical timer number (0..2)
+ */
+static void OnTimerUpdate(int timerNum)
+{
+    TIM_TypeDef* timer = TimerPtr[timerNum];
+    if (timer->SR & TIM_FLAG_Update) {
+        timer->SR &= ~TIM_FLAG_Update;
+        TimerExpired[timerNum] = true;
+    }
+}
+
+extern "C" void TIM3_IRQHandler(void)
+{
+    OnTimerUpdate(Timer::TIMER0);
+}
+
+extern "C" void TIM14_IRQHandler(void)
+{
+    OnTimerUpdate(Timer::TIMER1);
+}
+
+extern "C" void TIM17_IRQHandler(void)
+{
+    OnTimerUpdate(Timer::TIMER2);
+}
 
 /**
  * Configuring timers
@@ -21,6 +51,17 @@ void Timer::configure()
     RCC->APB1ENR |= RCC_APB1ENR_TIM14EN;
     RCC->APB2ENR |= RCC_APB2ENR_TIM17EN;
     RCC->APB2ENR |= RCC_APB2ENR_TIM16EN;
+    RCC->APB1ENR |= RCC_APB1ENR_TIM2EN;
+
+    // TIM2 is the free running microsecond counter
+    TIM_TimeBaseInitTypeDef  TIM_TimeBaseStruct;
+    TIM_TimeBaseStruct.TIM_Period = 0xFFFFFFFF;       // 32-bit autoload register
+    TIM_TimeBaseStruct.TIM_Prescaler = (SystemCoreClock / 1000000) - 1; // Divide to 1us
+    TIM_TimeBaseStruct.TIM_ClockDivision = TIM_CKD_DIV1;
+    TIM_TimeBaseStruct.TIM_CounterMode = (TIM_CounterMode_Up | TIM_OPMode_Repetitive);
+    TIM_TimeBaseStruct.TIM_RepetitionCounter = 0;
+    TIM_TimeBaseInit(TIM2, &TIM_TimeBaseStruct);
+    TIM2->CR1 |= TIM_CR1_CEN;
 }
 
 /**
@@ -30,6 +71,7 @@ void Timer::configure()
 Timer::Timer(int timerNum)
 {
     timer_ = TimerPtr[timerNum];
+    timerNum_ = timerNum;
     TIM_TimeBaseInitTypeDef  TIM_TimeBaseStruct;
     TIM_TimeBaseStruct.TIM_Period = 0xFFFF;           // Autoload register
     TIM_TimeBaseStruct.TIM_Prescaler = (tickDiv - 1); // Divide to 1ms
@@ -37,6 +79,11 @@ Timer::Timer(int timerNum)
     TIM_TimeBaseStruct.TIM_CounterMode = (TIM_CounterMode_Up | TIM_OPMode_Single);
     TIM_TimeBaseStruct.TIM_RepetitionCounter = 0;     // For TIM17
     TIM_TimeBaseInit(timer_, &TIM_TimeBaseStruct);
+    
+    // The update interrupt wakes up the core sleeping in WFI
+    timer_->SR = 0;
+    timer_->DIER |= TIM_IT_Update;
+    NVIC_EnableIRQ(TimerIrq[timerNum]);
 }
 
 /**
@@ -48,6 +95,7 @@ void Timer::start(uint32_t interval)
     timer_->ARR = interval;
     timer_->CNT = 0;
     timer_->SR  = 0; // Clear the flags
+    TimerExpired[timerNum_] = false;
     timer_->CR1 |= TIM_CR1_CEN; // Enable the TIMn timer
 }
 
@@ -57,7 +105,7 @@ void Timer::start(uint32_t interval)
  */
 bool Timer::isExpired() const
 {
-    return (timer_->SR & TIM_FLAG_Update);
+    return TimerExpired[timerNum_];
 }
 
 /**
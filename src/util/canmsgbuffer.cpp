@@ -12,7 +12,7 @@ using namespace std;
 
 
 CanMsgBuffer::CanMsgBuffer() 
-: id(0), extended(false), dlc(0), msgnum(0)
+: id(0), extended(false), rtr(false), dlc(0), msgnum(0), timestamp(0)
 {
     memset(data, 0, sizeof (data));
 }
@@ -29,7 +29,10 @@ CanMsgBuffer::CanMsgBuffer(uint32_t _id, bool _extended, uint8_t _dlc,
 {
     id = _id;
     extended = _extended;
+    rtr = false;
     dlc = _dlc;
+    msgnum = 0;
+    timestamp = 0;
     data[0] = _data0;
     data[1] = _data1;
     data[2] = _data2;
@@ -30,9 +30,11 @@ struct CanMsgBuffer {
         uint8_t _data7 = DefaultByte);
     uint32_t id;
     bool    extended;
+    bool    rtr;      // Remote transmission request, no data
     uint8_t dlc;
     uint8_t data[8];
     uint8_t msgnum;
+    uint32_t timestamp; // Receive time, microseconds
 };
 
 #endif //__CAN_MSG_BUFFER_H__